@@ -0,0 +1,107 @@
+#pragma once
+
+// Loads assets off the main thread so the window is up before anything has decoded.
+//
+// Each loader thread takes one asset at a time and owns a small ThreadPool for that asset's preprocessing
+// (SDF, outlines), so several maps decode side by side without fighting over one pool.
+// Anything touching GL is left to the render thread, e.g. DriveableArea creates its texture on first Render().
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+class AssetLoader {
+public:
+    // numLoaders assets in flight at once, the hardware threads are split between them
+    explicit AssetLoader(unsigned numLoaders = 2) {
+        numLoaders = std::max(1u, numLoaders);
+        const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+        const unsigned threadsEach = std::max(1u, hardware / numLoaders);
+        for (unsigned i = 0; i < numLoaders; ++i) {
+            m_threads.emplace_back([this, threadsEach]() { LoaderLoop(threadsEach); });
+        }
+    }
+
+    // Finishes the assets being loaded, queued ones are abandoned and their futures report broken_promise
+    ~AssetLoader() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+            m_jobs.clear();
+        }
+        m_wake.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+
+    AssetLoader(const AssetLoader&) = delete;
+    AssetLoader& operator=(const AssetLoader&) = delete;
+
+    // Builds T(pool, filename) on a loader thread, e.g. Load<DriveableArea>("road.d2map").
+    // Loading can fail without throwing, check the asset itself (DriveableArea::IsLoaded) once it is ready.
+    template<typename T>
+    std::shared_future<std::shared_ptr<const T>> Load(const std::string& filename) {
+        auto promise = std::make_shared<std::promise<std::shared_ptr<const T>>>();
+        std::shared_future<std::shared_ptr<const T>> future = promise->get_future().share();
+        Enqueue([promise, filename](ThreadPool& pool) {
+            promise->set_value(std::make_shared<T>(pool, filename.c_str()));
+        });
+        return future;
+    }
+
+    size_t NumQueued() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_jobs.size();
+    }
+
+private:
+    typedef std::function<void(ThreadPool&)> Job;
+
+    void Enqueue(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_wake.notify_one();
+    }
+
+    void LoaderLoop(unsigned numThreads) {
+        ThreadPool pool(numThreads);
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this]() { return m_quit || !m_jobs.empty(); });
+                if (m_quit) {
+                    return;
+                }
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            job(pool);
+        }
+    }
+
+    std::vector<std::thread>    m_threads;
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_wake;
+    std::deque<Job>             m_jobs;
+    bool                        m_quit = false;
+};
+
+// true once a future from AssetLoader has its value, never blocks
+template<typename T>
+static inline bool IsFutureReady(const std::shared_future<T>& f) {
+    return f.valid() && f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+// Bounding volume hierarchy over static line segments (road edges, obstacle outlines).
+// Built once, top down, splitting at the median centroid along the longer axis, so the tree is balanced
+// and a query for the segments near a point visits O(log n) nodes plus the ones it returns.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "geom.h"
+
+struct Segment
+{
+    Vec2D a, b;
+};
+
+class SegmentBvh {
+public:
+    static const int kLeafSize = 4;
+    static const int kMaxDepth = 64;
+
+    struct Node {
+        Vec2D       min, max;
+        uint32_t    first;      // leaf: first segment, inner: right child (left child is the next node)
+        uint32_t    count;      // segments in a leaf, 0 for inner nodes
+    };
+
+    void Build(const std::vector<Segment>& segments) {
+        m_segments = segments;
+        m_nodes.clear();
+        if (m_segments.empty()) {
+            return;
+        }
+        m_nodes.reserve(2 * m_segments.size() / kLeafSize + 1);
+        BuildNode(0, uint32_t(m_segments.size()), 0);
+    }
+
+    // a tree saved from Segments() and Nodes()
+    void Assign(const Segment* segments, size_t numSegments, const Node* nodes, size_t numNodes) {
+        m_segments.assign(segments, segments + numSegments);
+        m_nodes.assign(nodes, nodes + numNodes);
+    }
+
+    const std::vector<Segment>& Segments() const { return m_segments; }
+    const std::vector<Node>& Nodes() const { return m_nodes; }
+    size_t NumNodes() const { return m_nodes.size(); }
+
+    // fn(index, segment) for every segment whose bounding box is within radius of center
+    template<typename Fn>
+    void Query(const Vec2D& center, float radius, const Fn& fn) const {
+        if (m_nodes.empty()) {
+            return;
+        }
+        const float rSqr = radius * radius;
+        uint32_t stack[kMaxDepth];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const uint32_t ni = stack[--top];
+            const Node& n = m_nodes[ni];
+            const float dx = std::max(std::max(n.min.x - center.x, center.x - n.max.x), 0.0f);
+            const float dy = std::max(std::max(n.min.y - center.y, center.y - n.max.y), 0.0f);
+            if (dx * dx + dy * dy > rSqr) {
+                continue;
+            }
+            if (n.count > 0) {
+                for (uint32_t i = n.first; i < n.first + n.count; ++i) {
+                    fn(i, m_segments[i]);
+                }
+            } else {
+                stack[top++] = n.first;
+                stack[top++] = ni + 1;
+            }
+        }
+    }
+
+private:
+    uint32_t BuildNode(uint32_t first, uint32_t count, int depth) {
+        const uint32_t index = uint32_t(m_nodes.size());
+        m_nodes.push_back(Node());
+
+        Vec2D bmin(FLT_MAX, FLT_MAX), bmax(-FLT_MAX, -FLT_MAX);
+        Vec2D cmin(FLT_MAX, FLT_MAX), cmax(-FLT_MAX, -FLT_MAX);
+        for (uint32_t i = first; i < first + count; ++i) {
+            const Segment& s = m_segments[i];
+            bmin = Vec2D(std::min(bmin.x, std::min(s.a.x, s.b.x)), std::min(bmin.y, std::min(s.a.y, s.b.y)));
+            bmax = Vec2D(std::max(bmax.x, std::max(s.a.x, s.b.x)), std::max(bmax.y, std::max(s.a.y, s.b.y)));
+            const Vec2D c = Centroid(s);
+            cmin = Vec2D(std::min(cmin.x, c.x), std::min(cmin.y, c.y));
+            cmax = Vec2D(std::max(cmax.x, c.x), std::max(cmax.y, c.y));
+        }
+        m_nodes[index].min = bmin;
+        m_nodes[index].max = bmax;
+
+        // depth limit keeps the query stack bounded, balanced splits never get near it
+        if (count <= uint32_t(kLeafSize) || depth >= kMaxDepth / 2) {
+            m_nodes[index].first = first;
+            m_nodes[index].count = count;
+            return index;
+        }
+
+        const bool splitX = (cmax.x - cmin.x) >= (cmax.y - cmin.y);
+        const uint32_t mid = first + count / 2;
+        std::nth_element(m_segments.begin() + first, m_segments.begin() + mid, m_segments.begin() + first + count,
+            [splitX](const Segment& l, const Segment& r) {
+                const Vec2D cl = Centroid(l);
+                const Vec2D cr = Centroid(r);
+                return splitX ? cl.x < cr.x : cl.y < cr.y;
+            });
+
+        BuildNode(first, mid - first, depth + 1);
+        const uint32_t right = BuildNode(mid, first + count - mid, depth + 1);
+        m_nodes[index].first = right;
+        m_nodes[index].count = 0;
+        return index;
+    }
+
+    static Vec2D Centroid(const Segment& s) {
+        return Mult(Add(s.a, s.b), 0.5f);
+    }
+
+    std::vector<Segment>    m_segments;
+    std::vector<Node>       m_nodes;
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+// Boundary polygons of a binary mask: marching squares over pixel centres, then Douglas-Peucker.
+// Pixel (x, y) has its centre at world (x + 0.5, y + 0.5), the same convention as DriveableArea.
+// Outlines are closed and wind with the inside (mask != 0) on their left, so holes come out clockwise.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "geom.h"
+
+typedef std::vector<Vec2D> Polyline;
+
+// Every boundary between mask and not-mask as closed loops (first point not repeated at the end).
+// The mask is treated as zero outside the image so every loop closes.
+static inline void ExtractContours(const uint8_t* mask, int width, int height, std::vector<Polyline>& out)
+{
+    // corners are pixel centres on a grid padded by one on every side, cell (cx, cy) spans corners cx..cx+1, cy..cy+1
+    const int cw = width + 2;
+    auto inside = [&](int cx, int cy) -> int {
+        const int x = cx - 1;
+        const int y = cy - 1;
+        return (x >= 0 && y >= 0 && x < width && y < height && mask[size_t(y) * width + x]) ? 1 : 0;
+    };
+    // grid edge ids, horizontal edge from corner (cx, cy) to (cx + 1, cy) and vertical from (cx, cy) to (cx, cy + 1)
+    auto hEdge = [&](int cx, int cy) -> uint64_t { return (uint64_t(cy) * cw + cx) * 2; };
+    auto vEdge = [&](int cx, int cy) -> uint64_t { return (uint64_t(cy) * cw + cx) * 2 + 1; };
+    auto edgePoint = [&](uint64_t e) -> Vec2D {
+        const uint64_t c = e / 2;
+        const float cx = float(c % cw) - 0.5f; // corner (cx, cy) is the centre of pixel (cx - 1, cy - 1)
+        const float cy = float(c / cw) - 0.5f;
+        return (e & 1) ? Vec2D(cx, cy + 0.5f) : Vec2D(cx + 0.5f, cy);
+    };
+
+    // directed segments, from the edge where a counter clockwise walk round the cell leaves the inside
+    // to the edge where it re-enters, which keeps the inside on the left
+    std::unordered_map<uint64_t, uint64_t> next;
+    for (int cy = 0; cy < height + 1; ++cy) {
+        for (int cx = 0; cx < width + 1; ++cx) {
+            const int corner[4] = { inside(cx, cy), inside(cx + 1, cy), inside(cx + 1, cy + 1), inside(cx, cy + 1) };
+            if (corner[0] == corner[1] && corner[1] == corner[2] && corner[2] == corner[3]) {
+                continue;
+            }
+            // cell sides in counter clockwise order: bottom, right, top, left
+            const uint64_t side[4] = { hEdge(cx, cy), vEdge(cx + 1, cy), hEdge(cx, cy + 1), vEdge(cx, cy) };
+            int crossing[4];
+            bool leaving[4];
+            int numCrossings = 0;
+            for (int k = 0; k < 4; ++k) {
+                if (corner[k] != corner[(k + 1) & 3]) {
+                    crossing[numCrossings] = k;
+                    leaving[numCrossings] = corner[k] != 0;
+                    ++numCrossings;
+                }
+            }
+            // pair each exit with the entry just before it, in saddle cells this keeps diagonal inside pixels apart
+            for (int k = 0; k < numCrossings; ++k) {
+                if (leaving[k]) {
+                    const int entry = crossing[(k + numCrossings - 1) % numCrossings];
+                    next[side[crossing[k]]] = side[entry];
+                }
+            }
+        }
+    }
+
+    std::unordered_map<uint64_t, bool> visited;
+    visited.reserve(next.size());
+    for (const auto& start : next) {
+        if (visited[start.first]) {
+            continue;
+        }
+        Polyline loop;
+        uint64_t e = start.first;
+        while (!visited[e]) {
+            visited[e] = true;
+            loop.push_back(edgePoint(e));
+            auto it = next.find(e);
+            if (it == next.end()) {
+                break;
+            }
+            e = it->second;
+        }
+        if (loop.size() >= 3) {
+            out.push_back(loop);
+        }
+    }
+}
+
+// Signed area, positive for counter clockwise loops
+static inline float LoopArea(const Polyline& loop)
+{
+    float area = 0.0f;
+    for (size_t i = 0; i < loop.size(); ++i) {
+        area += Cross(loop[i], loop[(i + 1) % loop.size()]);
+    }
+    return 0.5f * area;
+}
+
+static inline float DistanceToSegment(const Vec2D& p, const Vec2D& a, const Vec2D& b)
+{
+    const Vec2D ab = Sub(b, a);
+    const float lenSqr = Dot(ab, ab);
+    float t = lenSqr > 0.0f ? Dot(Sub(p, a), ab) / lenSqr : 0.0f;
+    t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+    return Length(Sub(p, Add(a, Mult(ab, t))));
+}
+
+// Distance from p to a convex polygon (anticlockwise, see ConvexHull), 0 inside. 1 or 2 points are a point or a segment.
+static inline float DistanceToHull(const Vec2D& p, const Vec2D* hull, int n)
+{
+    if (n < 3) {
+        return DistanceToSegment(p, hull[0], hull[n - 1]);
+    }
+    bool inside = true;
+    float best = FLT_MAX;
+    for (int i = 0; i < n; ++i) {
+        const Vec2D& a = hull[i];
+        const Vec2D& b = hull[(i + 1) % n];
+        inside = inside && Cross(Sub(b, a), Sub(p, a)) >= 0.0f;
+        best = std::min(best, DistanceToSegment(p, a, b));
+    }
+    return inside ? 0.0f : best;
+}
+
+// Douglas-Peucker on the open polyline points[first..last], appends kept points except last
+static inline void SimplifyRange(const Polyline& points, size_t first, size_t last, float tolerance, Polyline& out)
+{
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.push_back(std::make_pair(first, last));
+    std::vector<uint8_t> keep(last - first + 1, 0);
+    keep[0] = 1;
+    while (!stack.empty()) {
+        const size_t a = stack.back().first;
+        const size_t b = stack.back().second;
+        stack.pop_back();
+        float maxDist = -1.0f;
+        size_t split = a;
+        for (size_t i = a + 1; i < b; ++i) {
+            const float d = DistanceToSegment(points[i], points[a], points[b]);
+            if (d > maxDist) {
+                maxDist = d;
+                split = i;
+            }
+        }
+        if (maxDist > tolerance) {
+            keep[split - first] = 1;
+            stack.push_back(std::make_pair(a, split));
+            stack.push_back(std::make_pair(split, b));
+        }
+    }
+    for (size_t i = first; i < last; ++i) {
+        if (keep[i - first]) {
+            out.push_back(points[i]);
+        }
+    }
+}
+
+// Simplify a closed loop, split at the first point and the point furthest from it so both halves are open.
+static inline Polyline SimplifyLoop(const Polyline& loop, float tolerance)
+{
+    Polyline out;
+    if (loop.size() < 4) {
+        return loop;
+    }
+    size_t far = 0;
+    float farDist = -1.0f;
+    for (size_t i = 1; i < loop.size(); ++i) {
+        const float d = Length(Sub(loop[i], loop[0]));
+        if (d > farDist) {
+            farDist = d;
+            far = i;
+        }
+    }
+    Polyline closed(loop);
+    closed.push_back(loop[0]);
+    SimplifyRange(closed, 0, far, tolerance, out);
+    SimplifyRange(closed, far, closed.size() - 1, tolerance, out);
+    return out;
+}
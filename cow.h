@@ -0,0 +1,44 @@
+#pragma once
+
+// Copy-on-write array. Copies share storage until one of them asks for write access,
+// which is what makes Simulator snapshots and forks O(1).
+
+#include <memory>
+#include <vector>
+
+template<typename T>
+class CowVector {
+public:
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    CowVector()
+    : m_data(std::make_shared<std::vector<T>>())
+    {
+    }
+
+    size_t size() const { return m_data->size(); }
+    bool empty() const { return m_data->empty(); }
+    const T& operator[](size_t i) const { return (*m_data)[i]; }
+    const_iterator begin() const { return m_data->begin(); }
+    const_iterator end() const { return m_data->end(); }
+    const std::vector<T>& Get() const { return *m_data; }
+
+    // true while another copy still references the same storage
+    bool IsShared() const { return m_data.use_count() > 1; }
+
+    // Write access, copies the storage first if it is shared.
+    // Call from one thread and hand the reference to workers, never call concurrently on the same CowVector.
+    std::vector<T>& Mutable() {
+        if (IsShared()) {
+            m_data = std::make_shared<std::vector<T>>(*m_data);
+        }
+        return *m_data;
+    }
+
+    void push_back(const T& v) {
+        Mutable().push_back(v);
+    }
+
+private:
+    std::shared_ptr<std::vector<T>> m_data;
+};
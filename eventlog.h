@@ -0,0 +1,198 @@
+#pragma once
+
+// Structured event and trajectory logging that stays off the simulation threads' critical path.
+//
+// Every worker thread gets its own single-producer single-consumer ring, pushing an event is a copy plus
+// one release store. A background thread drains the rings into a binary file. If the disk can't keep up the
+// rings fill and new events are dropped and counted, the simulation never waits on IO.
+//
+// file := Header LogEvent*   (events from different threads interleave, sort by tick if order matters)
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "platform.h"
+
+struct LogEvent
+{
+    enum Type : uint16_t {
+        kVehicleSample = 0,     // a = position, b = velocity
+        kCollision = 1,         // other = vehicle hit, a.x = distance, a.y = combined radius
+        kBlockedAll = 2,        // every cell of the VO map blocked, a = current velocity
+        kVelocityJump = 3,      // a = velocity before the tick, b = after
+    };
+
+    uint16_t    type;
+    uint16_t    pad;
+    uint32_t    tick;
+    uint32_t    vehicle;
+    uint32_t    other;
+    float       a[2];
+    float       b[2];
+};
+static_assert(sizeof(LogEvent) == 32, "keep events at half a cache line");
+
+// Fixed capacity SPSC ring, capacity must be a power of 2.
+template<typename T, size_t Capacity>
+class SpscRing {
+public:
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of 2");
+
+    // producer side, false when full
+    bool TryPush(const T& v) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_cachedTail == Capacity) {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head - m_cachedTail == Capacity) {
+                return false;
+            }
+        }
+        m_items[head & (Capacity - 1)] = v;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, pops up to maxCount items into out
+    size_t PopBatch(T* out, size_t maxCount) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        size_t count = head - tail;
+        if (count > maxCount) {
+            count = maxCount;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = m_items[(tail + i) & (Capacity - 1)];
+        }
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    // producer and consumer indices padded onto their own cache lines so they don't ping-pong,
+    // padding rather than alignas because rings are heap allocated
+    std::atomic<size_t>             m_head{ 0 };
+    size_t                          m_cachedTail = 0;
+    char                            m_pad0[64];
+    std::atomic<size_t>             m_tail{ 0 };
+    char                            m_pad1[64];
+    T                               m_items[Capacity];
+};
+
+class EventLog {
+public:
+    static const uint32_t kMagic = 0x56453244;     // "D2EV"
+    static const uint32_t kVersion = 1;
+    static const size_t kRingCapacity = 1 << 15;    // 1MB of events per thread
+    static const unsigned kMaxThreads = 64;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t eventSize;
+        uint32_t pad;
+    };
+
+    explicit EventLog(const char* filename)
+    : m_file(OpenFile(filename, "wb"))
+    {
+        for (auto& r : m_rings) {
+            r.store(nullptr);
+        }
+        if (m_file) {
+            Header header = { kMagic, kVersion, uint32_t(sizeof(LogEvent)), 0 };
+            fwrite(&header, sizeof(header), 1, m_file);
+            m_thread = std::thread([this]() { WriterLoop(); });
+        }
+    }
+
+    ~EventLog() {
+        if (m_file) {
+            m_quit.store(true);
+            m_thread.join();
+            fclose(m_file);
+        }
+        for (auto& r : m_rings) {
+            delete r.load();
+        }
+    }
+
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+    bool IsOpen() const { return m_file != nullptr; }
+
+    // Call only from the thread that owns worker index (see ThreadPool::ParallelFor).
+    // A worker's ring is allocated the first time it logs.
+    void Push(unsigned worker, const LogEvent& e) {
+        assert(worker < kMaxThreads);
+        Ring* ring = m_rings[worker].load(std::memory_order_acquire);
+        if (ring == nullptr) {
+            ring = new Ring();
+            m_rings[worker].store(ring, std::memory_order_release);
+        }
+        if (!ring->events.TryPush(e)) {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t Written() const { return m_written.load(std::memory_order_relaxed); }
+
+    uint64_t Dropped() const {
+        uint64_t dropped = 0;
+        for (auto& r : m_rings) {
+            const Ring* ring = r.load(std::memory_order_acquire);
+            if (ring) {
+                dropped += ring->dropped.load(std::memory_order_relaxed);
+            }
+        }
+        return dropped;
+    }
+
+private:
+    struct Ring {
+        SpscRing<LogEvent, kRingCapacity>   events;
+        std::atomic<uint64_t>               dropped{ 0 };
+    };
+
+    // drain every ring, returns the number of events written
+    size_t Drain() {
+        size_t total = 0;
+        for (auto& r : m_rings) {
+            Ring* ring = r.load(std::memory_order_acquire);
+            if (ring == nullptr) {
+                continue;
+            }
+            size_t count;
+            while ((count = ring->events.PopBatch(m_batch, kBatchSize)) > 0) {
+                fwrite(m_batch, sizeof(LogEvent), count, m_file);
+                total += count;
+            }
+        }
+        m_written.fetch_add(total, std::memory_order_relaxed);
+        return total;
+    }
+
+    void WriterLoop() {
+        while (!m_quit.load()) {
+            if (Drain() == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        Drain();
+    }
+
+    static const size_t kBatchSize = 1024;
+
+    FILE*                   m_file;
+    std::thread             m_thread;
+    std::atomic<bool>       m_quit{ false };
+    std::atomic<uint64_t>   m_written{ 0 };
+    std::atomic<Ring*>      m_rings[kMaxThreads];
+    LogEvent                m_batch[kBatchSize];    // writer thread only
+};
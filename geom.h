@@ -1,7 +1,9 @@
 #pragma once
 
 #define _USE_MATH_DEFINES
+#include <float.h>
 #include <math.h>
+#include <stdint.h>
 
 struct Vec2D
 {
@@ -29,6 +31,15 @@ static inline const Vec2D Sub(const Vec2D& a, const Vec2D& b) {
     return Vec2D(a.x - b.x, a.y - b.y);
 }
 
+static inline float Dot(const Vec2D& a, const Vec2D& b) {
+    return a.x * b.x + a.y * b.y;
+}
+
+// z of the 3D cross product, > 0 when b is counter clockwise from a
+static inline float Cross(const Vec2D& a, const Vec2D& b) {
+    return a.x * b.y - a.y * b.x;
+}
+
 static inline float Length(const Vec2D& a) {
     return sqrtf((a.x * a.x) + (a.y * a.y));
 }
@@ -43,4 +54,106 @@ static inline const Vec2D RotateRadians(const Vec2D& v, float radians)
 static inline const Vec2D Normalize(const Vec2D& a) {
     float len = Length(a);
     return Mult(a, 1.0f / len);
-}
\ No newline at end of file
+}
+
+// Z-order code of a 16 bit cell position, bits of x and y interleaved with x lowest
+static inline uint32_t MortonCode(uint32_t x, uint32_t y) {
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// true if segments a0-a1 and b0-b1 cross at a point inside both (touching or collinear doesn't count)
+static inline bool SegmentsCross(const Vec2D& a0, const Vec2D& a1, const Vec2D& b0, const Vec2D& b1) {
+    const Vec2D a = Sub(a1, a0);
+    const Vec2D b = Sub(b1, b0);
+    const float d0 = Cross(a, Sub(b0, a0));
+    const float d1 = Cross(a, Sub(b1, a0));
+    const float d2 = Cross(b, Sub(a0, b0));
+    const float d3 = Cross(b, Sub(a1, b0));
+    return ((d0 > 0.0f && d1 < 0.0f) || (d0 < 0.0f && d1 > 0.0f)) && ((d2 > 0.0f && d3 < 0.0f) || (d2 < 0.0f && d3 > 0.0f));
+}
+
+// Earliest t >= 0 at which origin + dir * t is within r of the segment s0-s1, FLT_MAX if never.
+// The origin is assumed to start outside.
+static inline float RayCapsuleTime(const Vec2D& origin, const Vec2D& dir, const Vec2D& s0, const Vec2D& s1, float r) {
+    float best = FLT_MAX;
+    const Vec2D axis = Sub(s1, s0);
+    const float len = Length(axis);
+    // end caps
+    const Vec2D* caps[2] = { &s0, &s1 };
+    const float a = Dot(dir, dir);
+    if (a > 0.0f) {
+        for (int k = 0; k < 2; ++k) {
+            const Vec2D o = Sub(origin, *caps[k]);
+            const float b = 2.0f * Dot(dir, o);
+            const float c = Dot(o, o) - r * r;
+            const float disc = b * b - 4.0f * a * c;
+            if (disc >= 0.0f) {
+                const float t = (-b - sqrtf(disc)) / (2.0f * a);
+                if (t >= 0.0f && t < best) {
+                    best = t;
+                }
+            }
+        }
+    }
+    // the two long sides
+    if (len > 0.0f) {
+        const Vec2D u = Mult(axis, 1.0f / len);
+        const Vec2D n(-u.y, u.x);
+        const Vec2D o = Sub(origin, s0);
+        const float ox = Dot(o, u);
+        const float oy = Dot(o, n);
+        const float dx = Dot(dir, u);
+        const float dy = Dot(dir, n);
+        if (dy != 0.0f) {
+            for (int side = -1; side <= 1; side += 2) {
+                const float t = (float(side) * r - oy) / dy;
+                const float x = ox + dx * t;
+                if (t >= 0.0f && t < best && x >= 0.0f && x <= len) {
+                    best = t;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+// Convex hull of points[0..n) into hull (room for n + 1), anticlockwise without collinear points, returns its size.
+// Sorts points in place. All points the same gives 1, all on a line gives the 2 ends.
+static inline int ConvexHull(Vec2D* points, int n, Vec2D* hull) {
+    // insertion sort by x then y, n is small
+    for (int i = 1; i < n; ++i) {
+        const Vec2D p = points[i];
+        int j = i;
+        for (; j > 0 && (points[j - 1].x > p.x || (points[j - 1].x == p.x && points[j - 1].y > p.y)); --j) {
+            points[j] = points[j - 1];
+        }
+        points[j] = p;
+    }
+    // Andrew's monotone chain, lower then upper
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        while (k >= 2 && Cross(Sub(hull[k - 1], hull[k - 2]), Sub(points[i], hull[k - 2])) <= 0.0f) {
+            --k;
+        }
+        hull[k++] = points[i];
+    }
+    for (int i = n - 2, lower = k + 1; i >= 0; --i) {
+        while (k >= lower && Cross(Sub(hull[k - 1], hull[k - 2]), Sub(points[i], hull[k - 2])) <= 0.0f) {
+            --k;
+        }
+        hull[k++] = points[i];
+    }
+    k = n > 1 ? k - 1 : k;  // the last point is the first again
+    if (k == 2 && hull[0].x == hull[1].x && hull[0].y == hull[1].y) {
+        k = 1;
+    }
+    return k;
+}
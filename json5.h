@@ -0,0 +1,468 @@
+#pragma once
+
+// SAX style JSON5 parser (https://json5.org) for scenario files.
+//
+// Reports values to a handler as it goes and never allocates: strings come back as views into the input
+// and nesting is tracked in a fixed size stack. Escaped strings are flagged, Json5Unescape() decodes them
+// into a caller buffer. Supports the parts of JSON5 people write by hand: unquoted keys, single quoted strings,
+// trailing commas, // and /* */ comments, hex numbers, leading or trailing decimal points, +Infinity and NaN.
+//
+// Handler interface, return false from any of them to stop parsing:
+//   bool OnBeginObject();  bool OnEndObject();  bool OnBeginArray();  bool OnEndArray();
+//   bool OnKey(const Json5String&);  bool OnString(const Json5String&);
+//   bool OnNumber(double);  bool OnBool(bool);  bool OnNull();
+
+#include <locale.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Json5String
+{
+    const char* data;       // between the quotes (or the bare key), escapes not decoded
+    size_t      size;
+    bool        escaped;    // contains a backslash, use Json5Unescape
+};
+
+struct Json5Error
+{
+    size_t      line = 0;   // 1 based
+    size_t      column = 0;
+    const char* message = nullptr;
+};
+
+static const int kJson5MaxDepth = 64;
+
+static inline int Json5HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decode s into out (capacity bytes, always NUL terminated), UTF-8 for \u escapes.
+// Returns the decoded length, which is more than capacity - 1 if out was too small and the result truncated.
+static inline size_t Json5Unescape(const Json5String& s, char* out, size_t capacity)
+{
+    size_t n = 0;
+    auto put = [&](char c) {
+        if (n + 1 < capacity) {
+            out[n] = c;
+        }
+        ++n;
+    };
+    for (size_t i = 0; i < s.size; ++i) {
+        char c = s.data[i];
+        if (c != '\\' || i + 1 >= s.size) {
+            put(c);
+            continue;
+        }
+        c = s.data[++i];
+        switch (c) {
+        case 'n': put('\n'); break;
+        case 't': put('\t'); break;
+        case 'r': put('\r'); break;
+        case 'b': put('\b'); break;
+        case 'f': put('\f'); break;
+        case 'v': put('\v'); break;
+        case '0': put('\0'); break;
+        case '\r':
+            if (i + 1 < s.size && s.data[i + 1] == '\n') {
+                ++i;
+            }
+            break;  // line continuation
+        case '\n':
+            break;
+        case 'x':
+        case 'u': {
+            const size_t digits = (c == 'x') ? 2 : 4;
+            uint32_t code = 0;
+            size_t k = 0;
+            for (; k < digits && i + 1 < s.size && Json5HexDigit(s.data[i + 1]) >= 0; ++k) {
+                code = code * 16 + uint32_t(Json5HexDigit(s.data[++i]));
+            }
+            // a high surrogate and the \uDC00-\uDFFF right after it are one character past U+FFFF
+            if (c == 'u' && k == 4 && code >= 0xd800 && code <= 0xdbff && i + 6 < s.size &&
+                s.data[i + 1] == '\\' && s.data[i + 2] == 'u') {
+                uint32_t low = 0;
+                size_t m = 0;
+                for (; m < 4 && Json5HexDigit(s.data[i + 3 + m]) >= 0; ++m) {
+                    low = low * 16 + uint32_t(Json5HexDigit(s.data[i + 3 + m]));
+                }
+                if (m == 4 && low >= 0xdc00 && low <= 0xdfff) {
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    i += 6;
+                }
+            }
+            if (code < 0x80) {
+                put(char(code));
+            } else if (code < 0x800) {
+                put(char(0xc0 | (code >> 6)));
+                put(char(0x80 | (code & 0x3f)));
+            } else if (code < 0x10000) {
+                put(char(0xe0 | (code >> 12)));
+                put(char(0x80 | ((code >> 6) & 0x3f)));
+                put(char(0x80 | (code & 0x3f)));
+            } else {
+                put(char(0xf0 | (code >> 18)));
+                put(char(0x80 | ((code >> 12) & 0x3f)));
+                put(char(0x80 | ((code >> 6) & 0x3f)));
+                put(char(0x80 | (code & 0x3f)));
+            }
+            break;
+        }
+        default:
+            put(c);     // \" \' \\ \/ and anything else stand for themselves
+            break;
+        }
+    }
+    if (capacity > 0) {
+        out[n < capacity ? n : capacity - 1] = '\0';
+    }
+    return n;
+}
+
+// One JSON5 number at p: an optional sign, then Infinity, NaN, 0x and hex digits, or decimal digits with an optional
+// fraction and exponent (no leading zeros, a point needs a digit on one side). Returns where it ends, nullptr if p
+// isn't one. Decimals are copied out with the C library's current decimal point so strtod reads them the same way
+// under any locale, and never sees anything JSON5 doesn't allow (hex floats, inf, nan(...)).
+static inline const char* Json5ParseNumber(const char* p, const char* end, double& v)
+{
+    const char* q = p;
+    const bool negative = q < end && *q == '-';
+    if (q < end && (*q == '+' || *q == '-')) {
+        ++q;
+    }
+    auto match = [&](const char* word) {
+        const size_t len = strlen(word);
+        if (size_t(end - q) < len || memcmp(q, word, len) != 0) {
+            return false;
+        }
+        q += len;
+        return true;
+    };
+    if (match("Infinity")) {
+        v = negative ? -HUGE_VAL : HUGE_VAL;
+        return q;
+    }
+    if (match("NaN")) {
+        v = NAN;
+        return q;
+    }
+    if (end - q > 2 && q[0] == '0' && (q[1] == 'x' || q[1] == 'X') && Json5HexDigit(q[2]) >= 0) {
+        double h = 0.0;
+        for (q += 2; q < end && Json5HexDigit(*q) >= 0; ++q) {
+            h = h * 16.0 + double(Json5HexDigit(*q));
+        }
+        v = negative ? -h : h;
+        return q;
+    }
+
+    char buffer[128];
+    size_t n = 0;
+    bool fits = true;
+    auto put = [&](char c) {
+        fits = fits && n + 1 < sizeof(buffer);
+        if (fits) {
+            buffer[n++] = c;
+        }
+    };
+    auto digits = [&]() {
+        const char* start = q;
+        for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+            put(*q);
+        }
+        return size_t(q - start);
+    };
+    if (negative) {
+        put('-');
+    }
+    size_t intDigits = 0;
+    if (q < end && *q == '0') {
+        put(*q++);
+        intDigits = 1;
+    } else {
+        intDigits = digits();
+    }
+    size_t fracDigits = 0;
+    if (q < end && *q == '.') {
+        ++q;
+        for (const char* point = localeconv()->decimal_point; *point; ++point) {
+            put(*point);
+        }
+        fracDigits = digits();
+    }
+    if (intDigits + fracDigits == 0) {
+        return nullptr;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        put('e');
+        ++q;
+        if (q < end && (*q == '+' || *q == '-')) {
+            put(*q++);
+        }
+        if (digits() == 0) {
+            return nullptr;
+        }
+    }
+    if (!fits) {
+        return nullptr;     // nobody writes a number this long by hand
+    }
+    buffer[n] = '\0';
+    char* converted = nullptr;
+    v = strtod(buffer, &converted);
+    return converted == buffer + n ? q : nullptr;
+}
+
+// true if s (decoded) equals the NUL terminated literal
+static inline bool Json5Equals(const Json5String& s, const char* literal)
+{
+    if (!s.escaped) {
+        const size_t len = strlen(literal);
+        return len == s.size && memcmp(s.data, literal, len) == 0;
+    }
+    char buffer[256];
+    const size_t len = Json5Unescape(s, buffer, sizeof(buffer));
+    return len < sizeof(buffer) && strcmp(buffer, literal) == 0;
+}
+
+// text is size bytes, it needn't be NUL terminated.
+template<typename Handler>
+static bool ParseJson5(const char* text, size_t size, Handler& handler, Json5Error* error = nullptr)
+{
+    const char* p = text;
+    const char* const end = text + size;
+    char stack[kJson5MaxDepth];     // '{' or '[' for every open container
+    int depth = 0;
+    enum State { kValue, kKey, kAfterValue } state = kValue;
+    const char* message = nullptr;
+
+    auto isIdentStart = [](char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$';
+    };
+    auto isIdentChar = [&](char c) {
+        return isIdentStart(c) || (c >= '0' && c <= '9');
+    };
+    // whitespace and comments, false on an unterminated block comment
+    auto skip = [&]() -> bool {
+        while (p < end) {
+            const char c = *p;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f') {
+                ++p;
+            } else if (c == '/' && p + 1 < end && p[1] == '/') {
+                while (p < end && *p != '\n') {
+                    ++p;
+                }
+            } else if (c == '/' && p + 1 < end && p[1] == '*') {
+                p += 2;
+                while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) {
+                    ++p;
+                }
+                if (p + 1 >= end) {
+                    p = end;
+                    return false;
+                }
+                p += 2;
+            } else {
+                break;
+            }
+        }
+        return true;
+    };
+    auto parseString = [&](Json5String& s) -> bool {
+        const char quote = *p++;
+        s.data = p;
+        s.escaped = false;
+        while (p < end && *p != quote) {
+            if (*p == '\n' || *p == '\r') {
+                return false;
+            }
+            if (*p == '\\') {
+                s.escaped = true;
+                ++p;
+                if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n') {
+                    ++p;
+                }
+            }
+            ++p;
+        }
+        if (p >= end) {
+            return false;
+        }
+        s.size = size_t(p - s.data);
+        ++p;
+        return true;
+    };
+    auto matchWord = [&](const char* word) -> bool {
+        const size_t len = strlen(word);
+        if (size_t(end - p) < len || memcmp(p, word, len) != 0 || (p + len < end && isIdentChar(p[len]))) {
+            return false;
+        }
+        p += len;
+        return true;
+    };
+
+    // UTF-8 byte order mark
+    if (size >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+        p += 3;
+    }
+
+    for (;;) {
+        if (!skip()) {
+            message = "unterminated comment";
+            break;
+        }
+        if (state == kAfterValue && depth == 0) {
+            if (p != end) {
+                message = "unexpected text after the top level value";
+            }
+            break;
+        }
+        if (p >= end) {
+            message = "unexpected end of input";
+            break;
+        }
+        const char c = *p;
+
+        if (state == kKey) {
+            if (c == '}') {
+                ++p;
+                --depth;
+                if (!handler.OnEndObject()) {
+                    message = "stopped by handler";
+                    break;
+                }
+                state = kAfterValue;
+                continue;
+            }
+            Json5String key;
+            if (c == '"' || c == '\'') {
+                if (!parseString(key)) {
+                    message = "unterminated string";
+                    break;
+                }
+            } else if (isIdentStart(c)) {
+                key.data = p;
+                key.escaped = false;
+                while (p < end && isIdentChar(*p)) {
+                    ++p;
+                }
+                key.size = size_t(p - key.data);
+            } else {
+                message = "expected a key";
+                break;
+            }
+            if (!skip() || p >= end || *p != ':') {
+                message = "expected ':' after key";
+                break;
+            }
+            ++p;
+            if (!handler.OnKey(key)) {
+                message = "stopped by handler";
+                break;
+            }
+            state = kValue;
+            continue;
+        }
+
+        if (state == kAfterValue) {
+            const char open = stack[depth - 1];
+            if (c == ',') {
+                ++p;
+                state = (open == '{') ? kKey : kValue;
+            } else if (c == '}' && open == '{') {
+                ++p;
+                --depth;
+                if (!handler.OnEndObject()) {
+                    message = "stopped by handler";
+                    break;
+                }
+            } else if (c == ']' && open == '[') {
+                ++p;
+                --depth;
+                if (!handler.OnEndArray()) {
+                    message = "stopped by handler";
+                    break;
+                }
+            } else {
+                message = (open == '{') ? "expected ',' or '}'" : "expected ',' or ']'";
+                break;
+            }
+            continue;
+        }
+
+        // kValue
+        bool ok = true;
+        if (c == ']' && depth > 0 && stack[depth - 1] == '[') {
+            // empty array or trailing comma
+            ++p;
+            --depth;
+            ok = handler.OnEndArray();
+        } else if (c == '{' || c == '[') {
+            if (depth == kJson5MaxDepth) {
+                message = "nested too deeply";
+                break;
+            }
+            ++p;
+            stack[depth++] = c;
+            if (c == '{') {
+                ok = handler.OnBeginObject();
+                state = kKey;
+            } else {
+                ok = handler.OnBeginArray();
+            }
+            if (!ok) {
+                message = "stopped by handler";
+                break;
+            }
+            continue;
+        } else if (c == '"' || c == '\'') {
+            Json5String s;
+            if (!parseString(s)) {
+                message = "unterminated string";
+                break;
+            }
+            ok = handler.OnString(s);
+        } else if (matchWord("true")) {
+            ok = handler.OnBool(true);
+        } else if (matchWord("false")) {
+            ok = handler.OnBool(false);
+        } else if (matchWord("null")) {
+            ok = handler.OnNull();
+        } else if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'I' || c == 'N') {
+            double v;
+            const char* numberEnd = Json5ParseNumber(p, end, v);
+            if (!numberEnd || (numberEnd < end && (isIdentChar(*numberEnd) || *numberEnd == '.'))) {
+                message = "bad number";
+                break;
+            }
+            p = numberEnd;
+            ok = handler.OnNumber(v);
+        } else {
+            message = "expected a value";
+            break;
+        }
+        if (!ok) {
+            message = "stopped by handler";
+            break;
+        }
+        state = kAfterValue;
+    }
+
+    if (message && error) {
+        error->message = message;
+        error->line = 1;
+        error->column = 1;
+        for (const char* q = text; q < p && q < end; ++q) {
+            if (*q == '\n') {
+                ++error->line;
+                error->column = 1;
+            } else {
+                ++error->column;
+            }
+        }
+    }
+    return message == nullptr;
+}
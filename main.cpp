@@ -17,6 +17,8 @@
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl2.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #ifdef __APPLE__
 #define GL_SILENCE_DEPRECATION
 #endif
@@ -86,8 +88,79 @@ GLFWmonitor* get_current_monitor(GLFWwindow* window)
 }
 
 // Main code
-int main(int, char**)
+// drive2d --make-tiles map.png map.d2tiles [tile size]
+static int MakeTiles(int argc, char** argv)
 {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s --make-tiles map.png map.d2tiles [tile size]\n", argv[0]);
+        return 1;
+    }
+    const int tileSize = argc > 4 ? atoi(argv[4]) : 256;
+    int w, h, channels;
+    unsigned char* data = stbi_load(argv[2], &w, &h, &channels, 4);
+    if (!data) {
+        fprintf(stderr, "can't load %s\n", argv[2]);
+        return 1;
+    }
+    const bool ok = WriteTiledMap(argv[3], data, w, h, tileSize);
+    stbi_image_free(data);
+    if (!ok) {
+        fprintf(stderr, "can't write %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
+
+// drive2d --compile-map map.png map.d2map
+static int CompileMap(int argc, char** argv)
+{
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s --compile-map map.png map.d2map\n", argv[0]);
+        return 1;
+    }
+    ThreadPool pool(0);
+    DriveableArea map(pool, argv[2]);
+    if (!map.IsLoaded()) {
+        fprintf(stderr, "can't load %s\n", argv[2]);
+        return 1;
+    }
+    if (!map.SaveCompiled(argv[3])) {
+        fprintf(stderr, "can't write %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--make-tiles") == 0) {
+        return MakeTiles(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "--compile-map") == 0) {
+        return CompileMap(argc, argv);
+    }
+    // drive2d --tiles map.d2tiles simulates and streams in a tiled map, the same as --map map.d2tiles
+    // drive2d --scenario file.json picks the vehicles and map, --map map.d2map (or an image) overrides its map
+    const char* mapFilename = nullptr;
+    const char* scenarioFilename = kDefaultScenario;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--map") == 0 || strcmp(argv[i], "--tiles") == 0) {
+            mapFilename = argv[i + 1];
+        } else if (strcmp(argv[i], "--scenario") == 0) {
+            scenarioFilename = argv[i + 1];
+        }
+    }
+    Scenario scenario;
+    std::vector<char> scenarioText;
+    Json5Error scenarioError;
+    if (!LoadScenario(scenarioFilename, scenario, scenarioText, &scenarioError)) {
+        fprintf(stderr, "%s(%zu,%zu): %s, using the test scenario\n", scenarioFilename, scenarioError.line, scenarioError.column, scenarioError.message);
+        scenario = Scenario::Test();
+    }
+    if (mapFilename) {
+        snprintf(scenario.driveableMap, sizeof(scenario.driveableMap), "%s", mapFilename);
+    }
+
     glfwSetErrorCallback(glfw_error_callback);
     if (!glfwInit())
         return 1;
@@ -150,9 +223,19 @@ int main(int, char**)
 
     //glShadeModel(GL_SMOOTH);                        // Enable Smooth Shading
 
-    std::unique_ptr<Simulator> sim = std::make_unique<Simulator>();
+    // the map decodes in the background, the sim starts ticking once it is in
+    AssetLoader loader;
+    std::unique_ptr<Simulator> sim = std::make_unique<Simulator>(loader, scenario);
     bool bQuit = false;
 
+    // replay scrubbing, while bPlayback is set the sim shows recorded ticks instead of simulating
+    const char* replayFilename = "replay.d2rp";
+    ReplayReader replay;
+    std::vector<ReplaySample> replayFrame;
+    bool bPlayback = false;
+    bool bReplayRunning = false;
+    int replayTick = 0;
+
     // Main loop
     while (!bQuit && !glfwWindowShouldClose(window))
     {
@@ -168,7 +251,26 @@ int main(int, char**)
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
-        sim->Update();
+        if (sim->MapFailed() && strcmp(scenario.MapFilename(), kDefaultMap) != 0) {
+            fprintf(stderr, "can't load map %s, falling back to %s\n", scenario.MapFilename(), kDefaultMap);
+            scenario.driveableMap[0] = '\0';
+            sim = std::make_unique<Simulator>(loader, scenario);
+        }
+
+        if (bPlayback && replay.IsOpen()) {
+            const int firstTick = int(replay.FirstTick());
+            const int lastTick = firstTick + int(replay.NumTicks()) - 1;
+            if (bReplayRunning && replayTick < lastTick) {
+                ++replayTick;
+            }
+            replayTick = std::min(std::max(replayTick, firstTick), lastTick);
+            if (replay.Seek(uint32_t(replayTick), replayFrame)) {
+                sim->ApplyReplayFrame(uint32_t(replayTick), replayFrame);
+            }
+        } else {
+            sim->Update();
+        }
+        sim->DrawDebugUI();
 
         // 1. Show the big demo window (Most of the sample code is in ImGui::ShowDemoWindow()! You can browse its code to learn more about Dear ImGui!).
         //if (show_demo_window)
@@ -204,6 +306,41 @@ int main(int, char**)
             ImGui::End();
         }
 
+        {
+            ImGui::Begin("Replay");
+            bool bRecording = sim->IsRecording();
+            if (ImGui::Checkbox("Record", &bRecording)) {
+                if (bRecording) {
+                    replay.Close();
+                    bPlayback = false;
+                    sim->StartRecording(replayFilename);
+                } else {
+                    sim->StopRecording();
+                }
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Load")) {
+                sim->StopRecording();
+                if (replay.Open(replayFilename)) {
+                    replayTick = int(replay.FirstTick());
+                    bPlayback = true;
+                }
+            }
+            ImGui::SameLine();
+            ImGui::Text("%s", replayFilename);
+
+            if (replay.IsOpen()) {
+                const int firstTick = int(replay.FirstTick());
+                const int lastTick = firstTick + int(replay.NumTicks()) - 1;
+                ImGui::Checkbox("Playback", &bPlayback);
+                ImGui::SameLine();
+                ImGui::Checkbox("Play", &bReplayRunning);
+                ImGui::SliderInt("tick", &replayTick, firstTick, lastTick);
+                ImGui::Text("%.1f s recorded", float(replay.NumTicks()) / 60.0f);
+            }
+            ImGui::End();
+        }
+
         // 3. Show another simple window.
         if (show_another_window)
         {
@@ -227,8 +364,9 @@ int main(int, char**)
         float ratio = float(width) / float(height);
         const float halfCamWidth = 50.0f; // TODO: define from scenario
         const float halfCamHeight = halfCamWidth / ratio; // metres
-        const float camPosX = sim->m_vehicles[0].m_pos.x;
-        const float camPosY = sim->m_vehicles[0].m_pos.y;
+        const Vec2D camPos = sim->NumVehicles() ? sim->VehicleByHandle(0).m_pos : Vec2D(0.0f, 0.0f);
+        const float camPosX = camPos.x;
+        const float camPosY = camPos.y;
 
         glMatrixMode(GL_PROJECTION);
         glLoadIdentity();
@@ -237,6 +375,7 @@ int main(int, char**)
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
 
+        sim->UpdateTiles(Vec2D(camPosX, camPosY), sqrtf(halfCamWidth * halfCamWidth + halfCamHeight * halfCamHeight));
         sim->Render();
 
         // Rendering
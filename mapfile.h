@@ -0,0 +1,202 @@
+#pragma once
+
+// Compiled maps (.d2map): the map image plus every layer derived from it, laid out so they can be used
+// straight from a memory mapping. Every section starts on a 4096 byte boundary, so arrays are aligned and
+// a process only pages in what it touches. Batch instances mapping the same file share the pages.
+//
+// file := Header SectionEntry[numSections] (padding) section*
+// Bump kVersion whenever a layer's layout or the parameters it is built with change so stale files are refused.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include "platform.h"
+
+struct MapFormat
+{
+    static const uint32_t kMagic = 0x504d3244;      // "D2MP"
+    static const uint32_t kVersion = 1;
+    static const uint64_t kAlignment = 4096;
+
+    enum SectionType : uint32_t {
+        kRgba = 1,              // width * height * 4, the image as drawn
+        kOccupancy = 2,         // width * height, 1 on the road
+        kOccupancyMips = 3,     // road coverage 0..255, every level halving down to 1x1, level 0 first
+        kSdf = 4,               // width * height floats, see BuildSignedDistanceField
+        kTrees = 5,             // width * height, 1 on a tree
+        kBoundaries = 6,        // uint32 numLoops, uint32 numPoints[numLoops], Vec2D points[]
+        kEdgeSegments = 7,      // Segment[], in SegmentBvh order
+        kEdgeNodes = 8,         // SegmentBvh::Node[]
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t numSections;
+        uint32_t pad[3];
+    };
+
+    struct SectionEntry {
+        uint32_t type;
+        uint32_t pad;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    static uint64_t Align(uint64_t offset) {
+        return (offset + kAlignment - 1) & ~(kAlignment - 1);
+    }
+};
+
+// Read-only array that either owns its elements or points into a mapped file.
+template<typename T>
+class MapLayer {
+public:
+    void Assign(std::vector<T>&& v) {
+        m_storage = std::move(v);
+        m_data = m_storage.data();
+        m_size = m_storage.size();
+    }
+
+    // the memory must outlive the layer
+    void View(const T* data, size_t size) {
+        m_storage.clear();
+        m_data = data;
+        m_size = size;
+    }
+
+    const T* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+
+private:
+    std::vector<T>  m_storage;
+    const T*        m_data = nullptr;
+    size_t          m_size = 0;
+};
+
+// Collects sections in memory and writes them out aligned.
+class MapFileWriter {
+public:
+    void AddSection(MapFormat::SectionType type, const void* data, size_t size) {
+        Section s;
+        s.type = type;
+        s.bytes.assign(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+        m_sections.push_back(std::move(s));
+    }
+
+    bool Write(const char* filename, uint32_t width, uint32_t height) const {
+        FILE* f = OpenFile(filename, "wb");
+        if (!f) {
+            return false;
+        }
+        MapFormat::Header header = {};
+        header.magic = MapFormat::kMagic;
+        header.version = MapFormat::kVersion;
+        header.width = width;
+        header.height = height;
+        header.numSections = uint32_t(m_sections.size());
+
+        std::vector<MapFormat::SectionEntry> table(m_sections.size());
+        uint64_t offset = sizeof(header) + table.size() * sizeof(MapFormat::SectionEntry);
+        for (size_t i = 0; i < m_sections.size(); ++i) {
+            offset = MapFormat::Align(offset);
+            table[i].type = m_sections[i].type;
+            table[i].pad = 0;
+            table[i].offset = offset;
+            table[i].size = m_sections[i].bytes.size();
+            offset += table[i].size;
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && (table.empty() || fwrite(table.data(), sizeof(MapFormat::SectionEntry), table.size(), f) == table.size());
+        uint64_t written = sizeof(header) + table.size() * sizeof(MapFormat::SectionEntry);
+        static const uint8_t zeros[MapFormat::kAlignment] = {};
+        for (size_t i = 0; ok && i < m_sections.size(); ++i) {
+            const size_t padding = size_t(table[i].offset - written);
+            ok = padding == 0 || fwrite(zeros, 1, padding, f) == padding;
+            const std::vector<uint8_t>& bytes = m_sections[i].bytes;
+            ok = ok && (bytes.empty() || fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+            written = table[i].offset + bytes.size();
+        }
+        fclose(f);
+        return ok;
+    }
+
+private:
+    struct Section {
+        MapFormat::SectionType  type;
+        std::vector<uint8_t>    bytes;
+    };
+
+    std::vector<Section> m_sections;
+};
+
+// Maps a compiled map and hands out pointers to its sections.
+class MapFile {
+public:
+    bool Open(const char* filename) {
+        Close();
+        if (!m_map.Open(filename) || m_map.Size() < sizeof(MapFormat::Header)) {
+            return false;
+        }
+        memcpy(&m_header, m_map.Data(), sizeof(m_header));
+        const uint64_t tableEnd = sizeof(m_header) + uint64_t(m_header.numSections) * sizeof(MapFormat::SectionEntry);
+        if (m_header.magic != MapFormat::kMagic || m_header.version != MapFormat::kVersion || tableEnd > m_map.Size()) {
+            Close();
+            return false;
+        }
+        m_table.resize(m_header.numSections);
+        if (!m_table.empty()) {
+            memcpy(m_table.data(), m_map.Data() + sizeof(m_header), m_table.size() * sizeof(MapFormat::SectionEntry));
+        }
+        for (const auto& e : m_table) {
+            if (e.offset > m_map.Size() || e.size > m_map.Size() - e.offset || (e.offset % MapFormat::kAlignment) != 0) {
+                Close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Close() {
+        m_map.Close();
+        m_table.clear();
+        m_header = MapFormat::Header();
+    }
+
+    bool IsOpen() const { return m_map.IsOpen(); }
+    uint32_t Width() const { return m_header.width; }
+    uint32_t Height() const { return m_header.height; }
+
+    // nullptr if the section is missing
+    const void* Section(MapFormat::SectionType type, size_t& size) const {
+        for (const auto& e : m_table) {
+            if (e.type == type) {
+                size = size_t(e.size);
+                return m_map.Data() + e.offset;
+            }
+        }
+        size = 0;
+        return nullptr;
+    }
+
+    // a section holding exactly count Ts, nullptr if missing or the wrong size
+    template<typename T>
+    const T* Array(MapFormat::SectionType type, size_t count) const {
+        size_t size;
+        const void* p = Section(type, size);
+        return (p && size == count * sizeof(T)) ? static_cast<const T*>(p) : nullptr;
+    }
+
+private:
+    MappedFile                          m_map;
+    MapFormat::Header                   m_header = {};
+    std::vector<MapFormat::SectionEntry> m_table;
+};
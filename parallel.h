@@ -0,0 +1,134 @@
+#pragma once
+
+// Minimal persistent thread pool for the simulation stages.
+// Work is handed out in fixed size chunks of an index range. Which thread runs a chunk is not deterministic,
+// so callers must only write to per-index slots and do any reductions afterwards in index order.
+// Stick to that and results are bit-identical for any thread count.
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    // numThreads includes the calling thread, 0 = one per hardware thread
+    explicit ThreadPool(unsigned numThreads = 0)
+    : m_count(0)
+    , m_grain(1)
+    , m_next(0)
+    , m_pending(0)
+    , m_generation(0)
+    , m_quit(false)
+    {
+        if (numThreads == 0) {
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 1; i < numThreads; ++i) {
+            m_threads.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        for (auto& t : m_threads) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned NumThreads() const {
+        return unsigned(m_threads.size()) + 1;
+    }
+
+    // fn(begin, end, worker) is called for consecutive chunks of [0, count), worker is in [0, NumThreads()).
+    // Blocks until every chunk is done. Not reentrant.
+    template<typename Fn>
+    void ParallelFor(size_t count, size_t grain, const Fn& fn) {
+        if (count == 0) {
+            return;
+        }
+        grain = std::max<size_t>(grain, 1);
+        if (m_threads.empty() || count <= grain) {
+            fn(size_t(0), count, 0u);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_ctx = &fn;
+            m_thunk = [](const void* ctx, size_t begin, size_t end, unsigned worker) {
+                (*static_cast<const Fn*>(ctx))(begin, end, worker);
+            };
+            m_count = count;
+            m_grain = grain;
+            m_next.store(0);
+            m_pending = unsigned(m_threads.size());
+            ++m_generation;
+        }
+        m_wake.notify_all();
+
+        RunChunks(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+private:
+    void RunChunks(unsigned worker) {
+        for (;;) {
+            size_t begin = m_next.fetch_add(m_grain);
+            if (begin >= m_count) {
+                break;
+            }
+            size_t end = std::min(begin + m_grain, m_count);
+            m_thunk(m_ctx, begin, end, worker);
+        }
+    }
+
+    void WorkerLoop(unsigned worker) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&]() { return m_quit || m_generation != seen; });
+                if (m_quit) {
+                    return;
+                }
+                seen = m_generation;
+            }
+            RunChunks(worker);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_pending;
+            }
+            m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread>    m_threads;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wake;
+    std::condition_variable     m_done;
+
+    // current job
+    const void*                 m_ctx = nullptr;
+    void                        (*m_thunk)(const void*, size_t, size_t, unsigned) = nullptr;
+    size_t                      m_count;
+    size_t                      m_grain;
+    std::atomic<size_t>         m_next;
+    unsigned                    m_pending;
+
+    uint64_t                    m_generation;
+    bool                        m_quit;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+// Thin wrappers over the few OS services the simulator needs that the C++ library doesn't cover.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// fopen without the MSVC deprecation error (SDL checks are on)
+static inline FILE* OpenFile(const char* filename, const char* mode) {
+#ifdef _MSC_VER
+    FILE* f = nullptr;
+    if (fopen_s(&f, filename, mode) != 0) {
+        return nullptr;
+    }
+    return f;
+#else
+    return fopen(filename, mode);
+#endif
+}
+
+// Whole file into buffer with a NUL after the last byte, the buffer's capacity is reused between calls.
+// size is the file size without the NUL.
+static inline bool ReadWholeFile(const char* filename, std::vector<char>& buffer, size_t& size) {
+    FILE* f = OpenFile(filename, "rb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fseek(f, 0, SEEK_END) == 0;
+    const long length = ok ? ftell(f) : -1;
+    ok = length >= 0 && fseek(f, 0, SEEK_SET) == 0;
+    if (ok) {
+        size = size_t(length);
+        buffer.resize(size + 1);
+        ok = fread(buffer.data(), 1, size, f) == size;
+        buffer[size] = '\0';
+    }
+    fclose(f);
+    return ok;
+}
+
+// Names of the regular files directly in dir that end in suffix, sorted so callers see a stable order.
+static inline bool ListFiles(const char* dir, const char* suffix, std::vector<std::string>& out) {
+    out.clear();
+    const size_t suffixLen = strlen(suffix);
+    auto matches = [&](const char* name) {
+        const size_t len = strlen(name);
+        return len >= suffixLen && strcmp(name + len - suffixLen, suffix) == 0;
+    };
+#ifdef _WIN32
+    std::string pattern = std::string(dir) + "\\*";
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(pattern.c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    do {
+        if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && matches(data.cFileName)) {
+            out.push_back(data.cFileName);
+        }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR* d = opendir(dir);
+    if (!d) {
+        return false;
+    }
+    while (struct dirent* e = readdir(d)) {
+        if (!matches(e->d_name)) {
+            continue;
+        }
+        struct stat st;
+        const std::string path = std::string(dir) + "/" + e->d_name;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            out.push_back(e->d_name);
+        }
+    }
+    closedir(d);
+#endif
+    std::sort(out.begin(), out.end());
+    return true;
+}
+
+// Read-only memory mapping of a whole file. Pages are shared between processes mapping the same file.
+class MappedFile {
+public:
+    MappedFile() {}
+
+    explicit MappedFile(const char* filename) {
+        Open(filename);
+    }
+
+    ~MappedFile() {
+        Close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const char* filename) {
+        Close();
+#ifdef _WIN32
+        m_file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+            Close();
+            return false;
+        }
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr) {
+            Close();
+            return false;
+        }
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_size = size_t(size.QuadPart);
+#else
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        m_data = static_cast<const uint8_t*>(p);
+        m_size = size_t(st.st_size);
+#endif
+        if (m_data == nullptr) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+#ifdef _WIN32
+        if (m_data) {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+        }
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data) {
+            munmap(const_cast<uint8_t*>(m_data), m_size);
+        }
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    bool IsOpen() const { return m_data != nullptr; }
+    const uint8_t* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+
+private:
+    const uint8_t*  m_data = nullptr;
+    size_t          m_size = 0;
+#ifdef _WIN32
+    HANDLE          m_file = INVALID_HANDLE_VALUE;
+    HANDLE          m_mapping = nullptr;
+#endif
+};
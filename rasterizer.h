@@ -3,8 +3,17 @@
 // https://trenki2.github.io/blog/2017/06/06/developing-a-software-renderer-part1/
 // TODO: add more optimzations from this article if needed
 
+#include <float.h>
+#include <stdint.h>
+
 #include <algorithm>
 #include <array>
+#include <memory>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "geom.h"
 
@@ -19,6 +28,13 @@ public:
     // make edges long enough too not need to worry about triangle vs infinite cone
     const float m_infEdgeLen = 1000.0f;
 
+    // points in a hull, the sum of two rectangles
+    static const int kMaxHull = 8;
+
+    // points on the near boundary of BlockedOutline(), and its most points
+    static const int kOutlineArc = 8;
+    static const int kMaxOutline = kOutlineArc + 2;
+
     struct Obstacle
     {
         Vertex  position;
@@ -27,8 +43,55 @@ public:
         // obstacle has right of way bias = 1.0, no right of way established ~0.4
         // obstacle giving way bias = 0.0
         float   bias;
+        // the shape is the rectangle position +- halfLength +- halfWidth grown by radius, zero for a disc
+        Vec2D   halfLength;
+        Vec2D   halfWidth;
+
+        bool HasCore() const {
+            return halfLength.x != 0.0f || halfLength.y != 0.0f || halfWidth.x != 0.0f || halfWidth.y != 0.0f;
+        }
+
+        // furthest the shape reaches from position
+        float Reach() const {
+            return HasCore() ? radius + Length(Add(halfLength, halfWidth)) : radius;
+        }
+
+        // corners of the core, 1 for a disc, 2 without a width
+        int CoreCorners(Vertex* corners) const {
+            const Vertex ends[2] = { Add(position, halfLength), Sub(position, halfLength) };
+            if (halfWidth.x == 0.0f && halfWidth.y == 0.0f) {
+                corners[0] = ends[0];
+                corners[1] = ends[1];
+                return HasCore() ? 2 : 1;
+            }
+            corners[0] = Add(ends[0], halfWidth);
+            corners[1] = Sub(ends[0], halfWidth);
+            corners[2] = Sub(ends[1], halfWidth);
+            corners[3] = Add(ends[1], halfWidth);
+            return 4;
+        }
     };
 
+    // Minkowski sum of points and a's core turned round, as a hull (room for kMaxHull). The shape a can't enter is
+    // that hull grown by a.radius plus however much the points stand for.
+    static int MinkowskiHull(const Obstacle& a, const Vertex* points, int numPoints, Vertex* hull) {
+        Obstacle core = a;
+        core.position = Vec2D(0.0f, 0.0f);
+        Vertex corners[4];
+        const int numCorners = core.CoreCorners(corners);
+        Vertex sums[4 * kMaxHull];
+        int n = 0;
+        for (int i = 0; i < numPoints; ++i) {
+            for (int k = 0; k < numCorners; ++k) {
+                sums[n++] = Sub(points[i], corners[k]);
+            }
+        }
+        Vertex scratch[4 * kMaxHull + 1];
+        const int numHull = ConvexHull(sums, n, scratch);
+        std::copy(scratch, scratch + numHull, hull);
+        return numHull;
+    }
+
     // e.g. B has complete right of way coef_b = 1.0, coef_a = 0.0
     // e.g. B has right of way, but A in encroaching on lane coef_b = 0.9, coef_a = 1.0
     // e.g. No right of way established coef_b = 0.4, coef_b = 0.4
@@ -41,16 +104,107 @@ public:
     , m_leftVertex(0.0, 0.0)
     , m_apex(0.0, 0.0)
     {
-        m_apex = Add(Mult(m_a.velocity, m_a.bias), Mult(m_b.velocity, m_b.bias));
         Vec2D offset = Sub(m_b.position, m_a.position);
         float dist = Length(offset);
         float r = (m_a.radius + m_b.radius);
         assert(r < dist);
-        float coneAngle = asinf(r / dist);
-        Vec2D leftEdge = RotateRadians(offset, -coneAngle);
-        m_leftEdgeDir = Normalize(leftEdge);
-        Vec2D rightEdge = RotateRadians(offset, coneAngle);
-        m_rightEdgeDir = Normalize(rightEdge);
+        ConeEdges(offset, dist, r, m_leftEdgeDir, m_rightEdgeDir);
+        SetupCone();
+    }
+
+    // Cone edges worked out beforehand, e.g. shared between a->b and b->a (see ConeEdges)
+    VelocityObstacle(const Obstacle& a, const Obstacle& b, const Vec2D& leftEdgeDir, const Vec2D& rightEdgeDir)
+    : m_a(a)
+    , m_b(b)
+    , m_rightEdgeDir(rightEdgeDir)
+    , m_leftEdgeDir(leftEdgeDir)
+    , m_apex(0.0, 0.0)
+    , m_leftVertex(0.0, 0.0)
+    , m_rightVertex(0.0, 0.0)
+    {
+        SetupCone();
+    }
+
+    // Unit edge directions of the cone from a towards b, offset = b - a, dist = |offset| > r = the radii summed.
+    // The half angle's sine is r / dist so no trig is needed. The cone from b towards a has exactly these negated.
+    static void ConeEdges(const Vec2D& offset, float dist, float r, Vec2D& leftEdgeDir, Vec2D& rightEdgeDir) {
+        const Vec2D dir = Mult(offset, 1.0f / dist);
+        const float s = r / dist;
+        const float c = sqrtf(std::max(1.0f - s * s, 0.0f));
+        leftEdgeDir = Vec2D(c * dir.x + s * dir.y, c * dir.y - s * dir.x);     // dir rotated by -asin(s)
+        rightEdgeDir = Vec2D(c * dir.x - s * dir.y, c * dir.y + s * dir.x);    // and by +asin(s)
+    }
+
+    // A static segment s0-s1 (road edge, obstacle outline) seen by agent a. The obstacle is the capsule of
+    // a.radius round the segment and the cone is bounded by the tangents to its end caps.
+    // The triangle only works while m_coneSpread < pi, split the segment and try again if it isn't.
+    VelocityObstacle(const Obstacle& a, const Vertex& s0, const Vertex& s1)
+    : m_a(a)
+    , m_rightEdgeDir(0.0, 0.0)
+    , m_leftEdgeDir(0.0, 0.0)
+    , m_apex(0.0, 0.0)
+    , m_leftVertex(0.0, 0.0)
+    , m_rightVertex(0.0, 0.0)
+    {
+        const Vertex hull[2] = { s0, s1 };
+        SetupHull(hull, 2, m_a.radius, Mult(m_a.velocity, m_a.bias));
+    }
+
+    // A convex hull (see ConvexHull, a segment for 2 points) grown by radius, moving so that the cone's apex is
+    // at apex, e.g. a capsule or box shaped vehicle as MinkowskiHull() of its corners. a.position must be outside.
+    // The same limit on m_coneSpread as for segments applies, split the hull if it's too wide.
+    VelocityObstacle(const Obstacle& a, const Vertex* hull, int numHull, float radius, const Vec2D& apex)
+    : m_a(a)
+    , m_rightEdgeDir(0.0, 0.0)
+    , m_leftEdgeDir(0.0, 0.0)
+    , m_apex(0.0, 0.0)
+    , m_leftVertex(0.0, 0.0)
+    , m_rightVertex(0.0, 0.0)
+    {
+        SetupHull(hull, numHull, radius, apex);
+    }
+
+    void SetupHull(const Vertex* hull, int numHull, float radius, const Vec2D& apex) {
+        m_isHull = true;
+        m_numHull = numHull;
+        m_hullRadius = radius;
+        Vec2D sum(0.0f, 0.0f);
+        for (int k = 0; k < numHull; ++k) {
+            m_hull[k] = hull[k];
+            sum = Add(sum, hull[k]);
+        }
+        m_b.position = Mult(sum, 1.0f / float(numHull));
+        m_b.velocity = Vec2D(0.0f, 0.0f);
+        m_b.radius = 0.0f;
+        m_b.bias = 1.0f;
+        m_apex = apex;
+
+        const Vec2D offset = Sub(m_b.position, m_a.position);
+        // angles relative to the bearing of the hull's centroid, clockwise negative
+        float lo = FLT_MAX;
+        float hi = -FLT_MAX;
+        for (int k = 0; k < numHull; ++k) {
+            const Vec2D e = Sub(hull[k], m_a.position);
+            const float theta = atan2f(Cross(offset, e), Dot(offset, e));
+            const float half = asinf(std::min(radius / Length(e), 1.0f));
+            lo = std::min(lo, theta - half);
+            hi = std::max(hi, theta + half);
+        }
+        m_coneSpread = hi - lo;
+
+        const Vec2D dir = Normalize(offset);
+        m_leftEdgeDir = RotateRadians(dir, lo);
+        m_rightEdgeDir = RotateRadians(dir, hi);
+        m_leftVertex = Add(m_apex, Mult(m_leftEdgeDir, m_infEdgeLen));
+        m_rightVertex = Add(m_apex, Mult(m_rightEdgeDir, m_infEdgeLen));
+
+        m_tri.v0 = m_apex;
+        m_tri.v1 = m_leftVertex;
+        m_tri.v2 = m_rightVertex;
+    }
+
+    void SetupCone() {
+        m_apex = Add(Mult(m_a.velocity, m_a.bias), Mult(m_b.velocity, m_b.bias));
         m_leftVertex = Add(m_apex, Mult(m_leftEdgeDir, m_infEdgeLen));
         m_rightVertex = Add(m_apex, Mult(m_rightEdgeDir, m_infEdgeLen));
 
@@ -59,9 +213,47 @@ public:
         m_tri.v2 = m_rightVertex;
     }
 
+    // Convex outline, anticlockwise (see ConvexHull), of the velocities that reach the obstacle within cutoff. Those are
+    // convex, the cone beyond its near boundary, so the outline is the far corners of the triangle and kOutlineArc
+    // points on the near boundary, apex + u * CalcTimeToCollision(apex + u) / cutoff for unit u across the cone.
+    // Returns its size, room for kMaxOutline.
+    int BlockedOutline(float cutoff, Vertex* outline) const {
+        Vertex points[kOutlineArc + 2];
+        int n = 0;
+        points[n++] = m_leftVertex;
+        points[n++] = m_rightVertex;
+        const float spread = atan2f(Cross(m_leftEdgeDir, m_rightEdgeDir), Dot(m_leftEdgeDir, m_rightEdgeDir));
+        // just inside the edges, a ray along one only grazes the obstacle
+        const float inset = 1e-3f * spread;
+        for (int k = 0; k < kOutlineArc; ++k) {
+            const float angle = inset + (spread - 2.0f * inset) * float(k) / float(kOutlineArc - 1);
+            const Vec2D u = RotateRadians(m_leftEdgeDir, angle);
+            const float time = CalcTimeToCollision(m_apex.x + u.x, m_apex.y + u.y);
+            if (time < FLT_MAX) {
+                points[n++] = Add(m_apex, Mult(u, time / cutoff));
+            }
+        }
+        Vertex hull[kOutlineArc + 3];
+        const int numHull = ConvexHull(points, n, hull);
+        std::copy(hull, hull + numHull, outline);
+        return numHull;
+    }
+
     float CalcTimeToCollision(float x, float y) const {
         Vec2D newVelocity(x, y);
         Vec2D relativeVelocity = Sub(newVelocity, m_apex);
+        if (m_isHull) {
+            if (m_numHull < 3) {
+                return RayCapsuleTime(m_a.position, relativeVelocity, m_hull[0], m_hull[m_numHull - 1], m_hullRadius);
+            }
+            // the grown hull is the union of capsules round its edges
+            float best = FLT_MAX;
+            for (int k = 0; k < m_numHull; ++k) {
+                const Vertex& next = m_hull[k + 1 < m_numHull ? k + 1 : 0];
+                best = std::min(best, RayCapsuleTime(m_a.position, relativeVelocity, m_hull[k], next, m_hullRadius));
+            }
+            return best;
+        }
         Vec2D relativePosition = Sub(m_a.position, m_b.position);
         float r_total = m_a.radius + m_b.radius;
         float r_total_sqr = r_total * r_total;
@@ -97,8 +289,150 @@ public:
     Vertex      m_rightVertex;
 
     Triangle    m_tri;
+
+    // segment and hull obstacles only
+    bool        m_isHull = false;
+    int         m_numHull = 0;
+    Vertex      m_hull[kMaxHull];
+    float       m_hullRadius = 0.0f;
+    float       m_coneSpread = 0.0f;
+};
+
+// Pre-rasterized footprints of disc against disc cones, see VORasterizer::DrawConeStamp(). On the grid a cone's
+// shape only depends on its bearing and half angle, the apex just moves it, so footprints are built once for binned
+// bearings and half angles in the first quadrant and mirrored into the others. For every column either side of the
+// apex cell a footprint holds the rows certainly inside each cone in the bin and the rows that might be inside any,
+// wherever the apex is within its cell.
+class ConeStampTable {
+public:
+    static const int kExtent = 128;         // columns either side of the apex cell
+    static const int kColumns = 2 * kExtent + 1;
+    static const int kBearingBins = 64;     // over the quadrant, binned by y / (x + y) to skip the atan2
+    static const int kSineBins = 32;        // over sin(half angle) = r / dist
+    static constexpr double kAngleMargin = 1e-3;    // rad, covers binning in float
+    static constexpr double kMaxHalfAngle = 1.4;    // rad, wider bins are left to the exact path
+
+    // rows relative to the apex cell, empty when lo > hi
+    struct Span
+    {
+        int16_t innerLo, innerHi;   // every cell is inside the cone
+        int16_t outerLo, outerHi;   // no cell outside is
+    };
+
+    // built on first use, later callers wait for it
+    static const ConeStampTable& Get() {
+        static const ConeStampTable table;
+        return table;
+    }
+
+    // The footprint for a cone along offset with r / dist = sine, nullptr if there is no usable one.
+    // Mirror columns if flipX and rows if flipY.
+    const Span* Find(const Vec2D& offset, float sine, bool& flipX, bool& flipY) const {
+        flipX = offset.x < 0.0f;
+        flipY = offset.y < 0.0f;
+        const float ux = fabsf(offset.x);
+        const float uy = fabsf(offset.y);
+        const int bearing = std::min(int(uy / (ux + uy) * float(kBearingBins)), kBearingBins - 1);
+        const int sineBin = std::min(int(sine * float(kSineBins)), kSineBins - 1);
+        const size_t stamp = size_t(bearing) * kSineBins + size_t(sineBin);
+        return m_usable[stamp] ? &m_spans[stamp * kColumns] : nullptr;
+    }
+
+private:
+    ConeStampTable()
+    : m_spans(size_t(kBearingBins) * kSineBins * kColumns)
+    , m_usable(size_t(kBearingBins) * kSineBins, 0)
+    {
+        for (int b = 0; b < kBearingBins; ++b) {
+            const double t0 = double(b) / kBearingBins;
+            const double t1 = double(b + 1) / kBearingBins;
+            const double theta0 = atan2(t0, 1.0 - t0);
+            const double theta1 = atan2(t1, 1.0 - t1);
+            const double axis = 0.5 * (theta0 + theta1);
+            const double spread = 0.5 * (theta1 - theta0);
+            for (int k = 0; k < kSineBins; ++k) {
+                const double alpha0 = asin(double(k) / kSineBins);
+                const double alpha1 = asin(std::min(double(k + 1) / kSineBins, 1.0));
+                const double inner = alpha0 - spread - kAngleMargin;
+                const double outer = alpha1 + spread + kAngleMargin;
+                const size_t stamp = size_t(b) * kSineBins + size_t(k);
+                if (outer >= kMaxHalfAngle) {
+                    continue;
+                }
+                m_usable[stamp] = 1;
+                for (int dx = -kExtent; dx <= kExtent; ++dx) {
+                    Span& span = m_spans[stamp * kColumns + size_t(dx + kExtent)];
+                    double lo0, hi0, lo1, hi1;
+                    // a cell covers [dx - 0.5, dx + 0.5] x [dy - 0.5, dy + 0.5] relative to the apex
+                    double innerLo = DBL_MAX, innerHi = -DBL_MAX;
+                    if (inner > 0.0) {
+                        ColumnRange(axis, inner, dx - 0.5, lo0, hi0);
+                        ColumnRange(axis, inner, dx + 0.5, lo1, hi1);
+                        // the cone is convex so the cell is inside if its corners are
+                        innerLo = std::max(lo0, lo1) + 0.5;
+                        innerHi = std::min(hi0, hi1) - 0.5;
+                    }
+                    ColumnRange(axis, outer, dx - 0.5, lo0, hi0);
+                    ColumnRange(axis, outer, dx + 0.5, lo1, hi1);
+                    // the cone's part in the column spans its crossings of the column's sides and the apex if in there
+                    double outerLo = std::min(lo0, lo1);
+                    double outerHi = std::max(hi0, hi1);
+                    if (dx == 0) {
+                        outerLo = std::min(outerLo, 0.0);
+                        outerHi = std::max(outerHi, 0.0);
+                    }
+                    span.innerLo = ClampRow(ceil(innerLo));
+                    span.innerHi = ClampRow(floor(innerHi));
+                    span.outerLo = ClampRow(ceil(outerLo - 0.5));
+                    span.outerHi = ClampRow(floor(outerHi + 0.5));
+                    if (outerLo > outerHi) {
+                        span.outerLo = 1;
+                        span.outerHi = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // y range where x = X crosses the cone from the origin along angle axis, lo > hi if it misses
+    static void ColumnRange(double axis, double halfAngle, double X, double& lo, double& hi) {
+        const double e1x = cos(axis - halfAngle), e1y = sin(axis - halfAngle);
+        const double e2x = cos(axis + halfAngle), e2y = sin(axis + halfAngle);
+        lo = -DBL_MAX;
+        hi = DBL_MAX;
+        // inside is cross(e1, w) >= 0 and cross(w, e2) >= 0, each p * y >= q along the column
+        auto clip = [&](double p, double q) {
+            if (p > 0.0) {
+                lo = std::max(lo, q / p);
+            } else if (p < 0.0) {
+                hi = std::min(hi, q / p);
+            } else if (q > 0.0) {
+                lo = DBL_MAX;
+                hi = -DBL_MAX;
+            }
+        };
+        clip(e1x, e1y * X);
+        clip(-e2x, -e2y * X);
+    }
+
+    static int16_t ClampRow(double row) {
+        return int16_t(std::min(std::max(row, double(-kExtent - 1)), double(kExtent + 1)));
+    }
+
+    std::vector<Span>       m_spans;    // kColumns per footprint, bearing major
+    std::vector<uint8_t>    m_usable;
 };
 
+static inline int CountTrailingZeros(uint64_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return int(index);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
 class VORasterizer {
 public:
     int m_minX, m_maxX;
@@ -108,27 +442,76 @@ public:
     static const int kRange = 128;
     static const int kHalfRange = kRange/2;
 
+    // only velocities that collide within this many seconds are blocked
+    static constexpr float kTimeCutoff = 1.0f;
+
+    // fastest speed on the grid (a corner cell), anything further away than this for kTimeCutoff can't block a cell
+    static float MaxGridSpeed() {
+        return float(kHalfRange) * float(M_SQRT2);
+    }
+
+    static const int kWords = kRange / 64;
+
+    // how far inside a cone, in m/s, a cell centre has to be for DrawConeStamp() to block it without the exact test
+    static constexpr float kStampMargin = 0.05f;
+
     // -50 ... 0 ... 50 inclusive
     std::array< std::array< float, kRange >, kRange >   m_map;
+    // one bit per cell of m_map, set where it is 0, so runs of cells are blocked a word at a time
+    std::array< std::array< uint64_t, kWords >, kRange > m_blocked;
 
     unsigned char m_data[4*kRange*kRange] = { 128 };
 
+    // VO of everything that doesn't move, built for one position cell and key, see Simulator::UpdateVelocityObstacles
+    std::array< std::array< float, kRange >, kRange >   m_staticMap;
+    std::array< std::array< uint64_t, kWords >, kRange > m_staticBlocked;
+    bool        m_staticValid = false;
+    int         m_staticCellX = 0;
+    int         m_staticCellY = 0;
+    uint64_t    m_staticKey = 0;
+
+    // pairs CanBlock() rejected and passed since ResetCounters()
+    uint32_t    m_culledPairs = 0;
+    uint32_t    m_acceptedPairs = 0;
+
+    // disc against disc cones go through ConeStampTable where they can, results are the same either way
+    bool        m_useConeStamps = true;
+
+    // m/s of velocity per cell, the grid covers about the same velocities whatever it is, see SetCellSize()
+    float       m_cellSize = 1.0f;
+    // cells keep the fraction of them every VO drawn leaves free instead of sampling their centre, see DrawCoverage()
+    bool        m_coverage = false;
+
+    // BuildProbability() was run on m_map as it is
+    bool        m_hasProbability = false;
+    // the debug view's rasterizer keeps a copy of its probabilities, the rest only use Probability()
+    bool        m_keepProbability = false;
+    std::unique_ptr< std::array< std::array< float, kRange >, kRange > > m_keptProbability;
+
+    // the debug texture is created on first use so rasterizers can be built and filled off the GL thread
     VORasterizer()
     : m_minX(-kHalfRange)
     , m_minY(-kHalfRange)
     , m_maxX(kHalfRange - 1)
     , m_maxY(kHalfRange - 1)
+    , m_texId(0)
     {
         Clear();
-        m_texId = glInitTexture();
     }
 
     void UpdateDebugTexture() {
+        if (m_texId == 0) {
+            m_texId = glInitTexture();
+        }
+
+        // probabilities are only built for the cells in use, see BuildProbability()
+        const int half = int(float(kHalfRange) / m_cellSize);
+        auto active = [&](int k) { return k >= kHalfRange - half && k < kHalfRange + half; };
         int runner = 0;
         for (int i = 0; i < kRange; ++i) {
             for (int j = 0; j < kRange; ++j) {
                 //float v = m_map[i][kRange - j - 1]; // flip and swap row/col to match debug draw of texture TODO: this might be a bug
-                float v = m_map[j][i]; // flip and swap row/col to match debug draw of texture TODO: this might be a bug
+                float v = m_hasProbability && m_keptProbability && active(i) && active(j) ? 1.0f - (*m_keptProbability)[j][i] : m_map[j][i]; // flip and swap row/col to match debug draw of texture TODO: this might be a bug
                 m_data[runner++] = int(v * 255.0f);
                 m_data[runner++] = int(v * 255.0f);
                 m_data[runner++] = int(v * 255.0f);
@@ -161,6 +544,351 @@ public:
         for (auto& row : m_map) {
             row.fill(1.0f);
         }
+        for (auto& column : m_blocked) {
+            column.fill(0);
+        }
+        m_hasProbability = false;
+    }
+
+    bool HasStaticLayer(int cellX, int cellY, uint64_t key) const {
+        return m_staticValid && m_staticCellX == cellX && m_staticCellY == cellY && m_staticKey == key;
+    }
+
+    // keep what has been drawn so far as the static layer
+    void StoreStaticLayer(int cellX, int cellY, uint64_t key) {
+        m_staticMap = m_map;
+        m_staticBlocked = m_blocked;
+        m_staticValid = true;
+        m_staticCellX = cellX;
+        m_staticCellY = cellY;
+        m_staticKey = key;
+    }
+
+    // start the map from the static layer instead of Clear(), dynamic obstacles are drawn on top
+    void LoadStaticLayer() {
+        m_map = m_staticMap;
+        m_blocked = m_staticBlocked;
+        m_hasProbability = false;
+    }
+
+    void InvalidateStaticLayer() {
+        m_staticValid = false;
+    }
+
+    // cellSize m/s per cell (>= 1) for kRange / cellSize cells a side, e.g. 4 for 32x32. Changes drop the static layer.
+    void SetCellSize(float cellSize) {
+        cellSize = std::min(std::max(cellSize, 1.0f), float(kHalfRange));
+        if (cellSize != m_cellSize) {
+            m_cellSize = cellSize;
+            ResetScissor();
+            m_staticValid = false;
+            Clear();
+        }
+    }
+
+    // Only cells covering velocities lo..hi are drawn and selected from from now on, at least one cell on the grid.
+    // Cells outside keep whatever they held, e.g. the static layer.
+    void SetScissor(const Vec2D& lo, const Vec2D& hi) {
+        const float half = float(kHalfRange) / m_cellSize;
+        // clamped before converting, lo and hi can be anywhere
+        auto cell = [&](float v) { return int(floorf(std::min(std::max(v / m_cellSize, -half), half))); };
+        const int limit = int(half);
+        m_minX = std::min(std::max(cell(lo.x), -limit), limit - 1);
+        m_minY = std::min(std::max(cell(lo.y), -limit), limit - 1);
+        m_maxX = std::min(std::max(cell(hi.x), m_minX), limit - 1);
+        m_maxY = std::min(std::max(cell(hi.y), m_minY), limit - 1);
+    }
+
+    // the whole grid
+    void ResetScissor() {
+        const int half = int(float(kHalfRange) / m_cellSize);
+        m_minX = m_minY = -half;
+        m_maxX = m_maxY = half - 1;
+    }
+
+    void SetCoverage(bool coverage) {
+        if (coverage != m_coverage) {
+            m_coverage = coverage;
+            m_staticValid = false;
+        }
+    }
+
+    void ResetCounters() {
+        m_culledPairs = 0;
+        m_acceptedPairs = 0;
+    }
+
+    // Conservative test before building a VelocityObstacle, false only if no cell in the scissor rect can reach b
+    // within kTimeCutoff. Whatever else it does, a's velocity relative to the apex has to close the gap along the
+    // line between centres, and the most any cell closes is at the rect corner furthest that way. No trig.
+    bool CanBlock(const VelocityObstacle::Obstacle& a, const VelocityObstacle::Obstacle& b) {
+        return CanBlock(a, b, Length(Sub(b.position, a.position)));
+    }
+
+    // the same with the distance between centres already known
+    bool CanBlock(const VelocityObstacle::Obstacle& a, const VelocityObstacle::Obstacle& b, float dist) {
+        const Vec2D offset = Sub(b.position, a.position);
+        const float gap = dist - (a.Reach() + b.Reach());
+        const Vec2D apex = Add(Mult(a.velocity, a.bias), Mult(b.velocity, b.bias));
+        const Vec2D corner((offset.x >= 0.0f ? float(m_maxX) + 0.5f : float(m_minX) + 0.5f) * m_cellSize,
+                           (offset.y >= 0.0f ? float(m_maxY) + 0.5f : float(m_minY) + 0.5f) * m_cellSize);
+        // closing speed * dist, compared against gap * dist to skip the divide
+        const float closing = Dot(Sub(corner, apex), offset);
+        if (gap > 0.0f && closing * kTimeCutoff <= gap * dist) {
+            ++m_culledPairs;
+            return false;
+        }
+        ++m_acceptedPairs;
+        return true;
+    }
+
+    // VO of an obstacle following a path rather than a straight line, seen from origin by an agent that does all the
+    // avoiding. At time t the velocities that meet it are the disc of radius / t round (position(t) - origin) / t.
+    // positions[k] are where it is at times[k], increasing up to kTimeCutoff. Discs of consecutive samples are joined
+    // by their convex hull, which is exactly the union between them while the obstacle moves in a straight line and
+    // the samples are even in 1 / t. Filled a column span at a time.
+    void DrawTrajectory(const Vec2D& origin, const Vec2D* positions, const float* times, int n, float radius) {
+        Vec2D prev = Mult(Sub(positions[0], origin), 1.0f / times[0]);
+        float prevRadius = radius / times[0];
+        for (int k = 1; k < n; ++k) {
+            const Vec2D center = Mult(Sub(positions[k], origin), 1.0f / times[k]);
+            const float r = radius / times[k];
+            DrawDiscHull(prev, prevRadius, center, r);
+            prev = center;
+            prevRadius = r;
+        }
+    }
+
+    // Convex hull of two discs, the cells whose centres it covers are blocked
+    void DrawDiscHull(const Vec2D& center0, float radius0, const Vec2D& center1, float radius1) {
+        if (m_coverage) {
+            // inscribed polygons, kDiscPoints of them round each disc
+            const int kDiscPoints = 16;
+            Vertex points[2 * kDiscPoints];
+            for (int k = 0; k < kDiscPoints; ++k) {
+                const Vec2D u = RotateRadians(Vec2D(1.0f, 0.0f), float(2.0 * M_PI) * float(k) / float(kDiscPoints));
+                points[k] = Add(center0, Mult(u, radius0));
+                points[kDiscPoints + k] = Add(center1, Mult(u, radius1));
+            }
+            Vertex hull[2 * kDiscPoints + 1];
+            DrawCoverage(hull, ConvexHull(points, 2 * kDiscPoints, hull));
+            return;
+        }
+        // in cells from here on
+        const float scale = 1.0f / m_cellSize;
+        const Vec2D c0 = Mult(center0, scale);
+        const Vec2D c1 = Mult(center1, scale);
+        const float r0 = radius0 * scale;
+        const float r1 = radius1 * scale;
+        // outer tangents touch at c + r * n, with n . (c1 - c0) = (r0 - r1) |c1 - c0|, none if one disc holds the other
+        const Vec2D d = Sub(c1, c0);
+        const float len = Length(d);
+        bool tangents = len > fabsf(r1 - r0);
+        Vec2D p[2], q[2];
+        if (tangents) {
+            const Vec2D e = Mult(d, 1.0f / len);
+            const float k = (r0 - r1) / len;
+            const float h = sqrtf(std::max(1.0f - k * k, 0.0f));
+            for (int side = 0; side < 2; ++side) {
+                const float s = side ? h : -h;
+                const Vec2D normal(k * e.x - s * e.y, k * e.y + s * e.x);
+                p[side] = Add(c0, Mult(normal, r0));
+                q[side] = Add(c1, Mult(normal, r1));
+            }
+        }
+        // clamped before converting, discs early in the horizon can be very far off the grid
+        const float lo = std::max(std::min(c0.x - r0, c1.x - r1), float(m_minX) - 1.0f);
+        const float hi = std::min(std::max(c0.x + r0, c1.x + r1), float(m_maxX) + 2.0f);
+        const int minX = std::max(int(ceilf(lo - 0.5f)), m_minX);
+        const int maxX = std::min(int(floorf(hi - 0.5f)), m_maxX);
+        for (int x = minX; x <= maxX; ++x) {
+            // the hull is convex, so along the column it runs between the lowest and highest boundary crossing
+            const float xc = float(x) + 0.5f;
+            float yLo = FLT_MAX;
+            float yHi = -FLT_MAX;
+            auto disc = [&](const Vec2D& c, float r) {
+                const float dx = xc - c.x;
+                if (fabsf(dx) <= r) {
+                    const float h = sqrtf(r * r - dx * dx);
+                    yLo = std::min(yLo, c.y - h);
+                    yHi = std::max(yHi, c.y + h);
+                }
+            };
+            disc(c0, r0);
+            disc(c1, r1);
+            for (int side = 0; tangents && side < 2; ++side) {
+                const Vec2D& a = p[side];
+                const Vec2D& b = q[side];
+                if (a.x != b.x && (xc - a.x) * (xc - b.x) <= 0.0f) {
+                    const float y = a.y + (b.y - a.y) * (xc - a.x) / (b.x - a.x);
+                    yLo = std::min(yLo, y);
+                    yHi = std::max(yHi, y);
+                }
+            }
+            if (yLo > yHi) {
+                continue;
+            }
+            const int y0 = int(ceilf(std::max(yLo, float(m_minY)) - 0.5f));
+            const int y1 = int(floorf(std::min(yHi, float(m_maxY) + 1.0f) - 0.5f));
+            if (y0 <= y1) {
+                BlockRun(x, y0, y1);
+            }
+        }
+    }
+
+    // Nearest free cell centre to the preferred velocity, searching outwards ring by ring.
+    // Returns false and leaves the preferred velocity if every cell is blocked.
+    // With m_coverage only cells nothing covers are free, and any velocity in them is, so it's the nearest of those.
+    bool SelectVelocity(const Vec2D& preferred, Vec2D& out) const {
+        if (m_coverage) {
+            return SelectVelocityWhere(preferred, out, [&](int x, int y) { return m_map[x][y] < 1.0f; }, true);
+        }
+        return SelectVelocityWhere(preferred, out, [&](int x, int y) { return m_map[x][y] < 0.5f; });
+    }
+
+    // The same but only cells whose collision probability is over maxProbability are blocked,
+    // BuildProbability() first on the same thread
+    bool SelectVelocity(const Vec2D& preferred, Vec2D& out, float maxProbability) const {
+        const std::array< std::array< float, kRange >, kRange >& probability = Probability();
+        return SelectVelocityWhere(preferred, out, [&](int x, int y) { return probability[x][y] > maxProbability; });
+    }
+
+    // Chance each cell's velocity collides from the last BuildProbability() on this thread, whichever rasterizer
+    // that was. Per thread rather than per rasterizer as it is only needed between building and selecting.
+    static std::array< std::array< float, kRange >, kRange >& Probability() {
+        static thread_local std::array< std::array< float, kRange >, kRange > probability;
+        return probability;
+    }
+
+    // Collision probability of every cell for a velocity known to within sigma m/s, m_map's blocked cells
+    // blurred by a Gaussian. That is three box blurs along each axis, each a running sum so the cost doesn't
+    // depend on sigma. Only the kRange / m_cellSize cells in use are blurred, cells past their edge count as
+    // the nearest edge cell and the rest of Probability() is left as it was.
+    void BuildProbability(float sigma) {
+        // odd box widths whose variances ((w^2 - 1) / 12) add up to sigma^2 as closely as they can, the first
+        // passes one width and the rest the next odd one up
+        const int kPasses = 3;
+        const float cells = sigma / m_cellSize;
+        const float variance = 12.0f * cells * cells;
+        int lower = int(floorf(sqrtf(variance / float(kPasses) + 1.0f)));
+        lower -= (lower % 2 == 0) ? 1 : 0;
+        const float numLower = (variance - float(kPasses * (lower * lower + 4 * lower + 3))) / float(-4 * lower - 4);
+        const int lowerPasses = std::min(std::max(int(floorf(numLower + 0.5f)), 0), kPasses);
+        int radii[kPasses];
+        for (int k = 0; k < kPasses; ++k) {
+            radii[k] = k < lowerPasses ? (lower - 1) / 2 : (lower + 1) / 2;
+        }
+
+        static thread_local std::array< std::array< float, kRange >, kRange > scratch;
+        std::array< std::array< float, kRange >, kRange >& probability = Probability();
+        const int half = int(float(kHalfRange) / m_cellSize);
+        const int lo = kHalfRange - half;
+        const int hi = kHalfRange + half;
+        for (int x = lo; x < hi; ++x) {
+            for (int y = lo; y < hi; ++y) {
+                probability[x][y] = 1.0f - m_map[x][y];
+            }
+        }
+        if (radii[kPasses - 1] > 0) {
+            // along x, then the same along y on the transpose
+            for (int axis = 0; axis < 2; ++axis) {
+                BoxBlurColumns(probability, scratch, radii[0], lo, hi);
+                BoxBlurColumns(scratch, probability, radii[1], lo, hi);
+                BoxBlurColumns(probability, scratch, radii[2], lo, hi);
+                Transpose(scratch, probability, lo, hi);
+            }
+        }
+        if (m_keepProbability) {
+            if (!m_keptProbability) {
+                m_keptProbability.reset(new std::array< std::array< float, kRange >, kRange >());
+            }
+            *m_keptProbability = probability;
+        }
+        m_hasProbability = true;
+    }
+
+    // blocked(x, y) with x and y indices into m_map, anywhere in a free cell rather than its centre if wholeCell
+    template<typename Blocked>
+    bool SelectVelocityWhere(const Vec2D& preferred, Vec2D& out, const Blocked& blocked, bool wholeCell = false) const {
+        const int cx = std::min(std::max(int(floorf(preferred.x / m_cellSize)), m_minX), m_maxX);
+        const int cy = std::min(std::max(int(floorf(preferred.y / m_cellSize)), m_minY), m_maxY);
+        float bestDistSqr = FLT_MAX;
+        out = preferred;
+        for (int r = 0; r < kRange; ++r) {
+            // every cell on ring r is at least r - 1 cells from the preferred velocity
+            float ringDist = float(std::max(r - 1, 0)) * m_cellSize;
+            if (ringDist * ringDist > bestDistSqr) {
+                break;
+            }
+            for (int x = cx - r; x <= cx + r; ++x) {
+                if (x < m_minX || x > m_maxX) {
+                    continue;
+                }
+                const bool edgeColumn = (x == cx - r || x == cx + r);
+                const int step = edgeColumn ? 1 : 2 * r;
+                for (int y = cy - r; y <= cy + r; y += std::max(step, 1)) {
+                    if (y < m_minY || y > m_maxY) {
+                        continue;
+                    }
+                    if (blocked(x + kHalfRange, y + kHalfRange)) {
+                        continue;
+                    }
+                    Vec2D v((float(x) + 0.5f) * m_cellSize, (float(y) + 0.5f) * m_cellSize);
+                    if (wholeCell) {
+                        v.x = std::min(std::max(preferred.x, float(x) * m_cellSize), float(x + 1) * m_cellSize);
+                        v.y = std::min(std::max(preferred.y, float(y) * m_cellSize), float(y + 1) * m_cellSize);
+                    }
+                    Vec2D d = Sub(v, preferred);
+                    float distSqr = d.x * d.x + d.y * d.y;
+                    if (distSqr < bestDistSqr) {
+                        bestDistSqr = distSqr;
+                        out = v;
+                    }
+                }
+            }
+        }
+        return bestDistSqr < FLT_MAX;
+    }
+
+    // dst[x] = mean of src[x - radius .. x + radius] for x and y in lo..hi-1, clamped to that square. The running sum
+    // is a whole column so every inner loop is contiguous and branch free for the compiler to vectorize.
+    static void BoxBlurColumns(const std::array< std::array< float, kRange >, kRange >& src,
+                               std::array< std::array< float, kRange >, kRange >& dst, int radius, int lo, int hi) {
+        const float scale = 1.0f / float(2 * radius + 1);
+        std::array< float, kRange > sum;
+        for (int y = lo; y < hi; ++y) {
+            sum[y] = float(radius + 1) * src[lo][y];
+        }
+        for (int k = 1; k <= radius; ++k) {
+            const float* add = src[std::min(lo + k, hi - 1)].data();
+            for (int y = lo; y < hi; ++y) {
+                sum[y] += add[y];
+            }
+        }
+        for (int x = lo; x < hi; ++x) {
+            const float* add = src[std::min(x + radius + 1, hi - 1)].data();
+            const float* sub = src[std::max(x - radius, lo)].data();
+            float* out = dst[x].data();
+            for (int y = lo; y < hi; ++y) {
+                out[y] = sum[y] * scale;
+                sum[y] += add[y] - sub[y];
+            }
+        }
+    }
+
+    // the lo..hi-1 square, in kTile square tiles so neither side strides through the whole map
+    static void Transpose(const std::array< std::array< float, kRange >, kRange >& src,
+                          std::array< std::array< float, kRange >, kRange >& dst, int lo, int hi) {
+        const int kTile = 8;
+        for (int x0 = lo; x0 < hi; x0 += kTile) {
+            for (int y0 = lo; y0 < hi; y0 += kTile) {
+                for (int x = x0; x < std::min(x0 + kTile, hi); ++x) {
+                    for (int y = y0; y < std::min(y0 + kTile, hi); ++y) {
+                        dst[y][x] = src[x][y];
+                    }
+                }
+            }
+        }
     }
 
 struct EdgeEquation {
@@ -202,11 +930,12 @@ void drawTriangle(const VelocityObstacle& vo)
     const Vertex& v1 = vo.m_tri.v1;
     const Vertex& v2 = vo.m_tri.v2;
 
-    // Compute triangle bounding box.
-    int minX = (int)std::min(std::min(v0.x, v1.x), v2.x);
-    int maxX = (int)std::max(std::max(v0.x, v1.x), v2.x);
-    int minY = (int)std::min(std::min(v0.y, v1.y), v2.y);
-    int maxY = (int)std::max(std::max(v0.y, v1.y), v2.y);
+    // Compute triangle bounding box in cells.
+    const float scale = 1.0f / m_cellSize;
+    int minX = (int)(std::min(std::min(v0.x, v1.x), v2.x) * scale);
+    int maxX = (int)(std::max(std::max(v0.x, v1.x), v2.x) * scale);
+    int minY = (int)(std::min(std::min(v0.y, v1.y), v2.y) * scale);
+    int maxY = (int)(std::max(std::max(v0.y, v1.y), v2.y) * scale);
 
     // Clip to scissor rect.
     minX = std::max(minX, m_minX);
@@ -227,35 +956,223 @@ void drawTriangle(const VelocityObstacle& vo)
         return;
     }
 
-    //ParameterEquation r(v0.r, v1.r, v2.r, e0, e1, e2, area);
-    //ParameterEquation g(v0.g, v1.g, v2.g, e0, e1, e2, area);
-    //ParameterEquation b(v0.b, v1.b, v2.b, e0, e1, e2, area);
+    if (m_coverage) {
+        Vertex outline[VelocityObstacle::kMaxOutline];
+        DrawCoverage(outline, vo.BlockedOutline(kTimeCutoff, outline));
+        return;
+    }
+
+    if (m_useConeStamps && m_cellSize == 1.0f && !vo.m_isHull && DrawConeStamp(vo, e0, e1, e2, minX, maxX, minY, maxY)) {
+        return;
+    }
 
-    // Add 0.5 to sample at pixel centers.
     for (int x = minX, xm = maxX; x <= xm; x++) {
         for (int y = minY, ym = maxY; y <= ym; y++) {
-            float xf = float(x) + 0.5f;
-            float yf = float(y) + 0.5f;
-
-            if (e0.test(xf, yf) && e1.test(xf, yf) && e2.test(xf, yf)) {
-                int iX = x + kHalfRange;
-                int iY = y + kHalfRange;
-                //int rint = r.evaluate(x, y) * 255;
-                //int gint = g.evaluate(x, y) * 255;
-                //int bint = b.evaluate(x, y) * 255;
-                //Uint32 color = SDL_MapRGB(m_surface->format, rint, gint, bint);
-                //putpixel(m_surface, x, y, color);
-                float timeToCollision = vo.CalcTimeToCollision(xf, yf);
-                static float kTimeCutoff = 1.0f;
-                if (timeToCollision < kTimeCutoff) {
-                    m_map[iX][iY] = 0.0f;
-                }
-                int i = 0; ++i;
+            DrawCell(vo, e0, e1, e2, x, y);
+        }
+    }
+}
+
+// Blocks the cell if the triangle covers its centre and the obstacle is reached within kTimeCutoff
+void DrawCell(const VelocityObstacle& vo, EdgeEquation& e0, EdgeEquation& e1, EdgeEquation& e2, int x, int y)
+{
+    // Add 0.5 to sample at pixel centers.
+    float xf = (float(x) + 0.5f) * m_cellSize;
+    float yf = (float(y) + 0.5f) * m_cellSize;
+
+    int iX = x + kHalfRange;
+    int iY = y + kHalfRange;
+    uint64_t& word = m_blocked[iX][iY >> 6];
+    const uint64_t bit = uint64_t(1) << (iY & 63);
+    if (word & bit) {
+        return;     // already blocked, skip the time to collision
+    }
+    if (e0.test(xf, yf) && e1.test(xf, yf) && e2.test(xf, yf)) {
+        float timeToCollision = vo.CalcTimeToCollision(xf, yf);
+        if (timeToCollision < kTimeCutoff) {
+            m_map[iX][iY] = 0.0f;
+            word |= bit;
+        }
+    }
+}
+
+// Area coverage of the convex anticlockwise polygon (at most kMaxCoverage points), exact for the polygon. Each cell
+// keeps the fraction of it left free by everything drawn so far, overlaps taken as independent, and is blocked
+// outright once kFullCoverage of it is covered. The polygon is cut to each column's slab once, then to each cell.
+static const int kMaxCoverage = 40;
+static constexpr float kFullCoverage = 0.999f;
+
+void DrawCoverage(const Vertex* polygon, int n)
+{
+    if (n < 3) {
+        return;
+    }
+    float lo = FLT_MAX;
+    float hi = -FLT_MAX;
+    for (int k = 0; k < n; ++k) {
+        lo = std::min(lo, polygon[k].x);
+        hi = std::max(hi, polygon[k].x);
+    }
+    const float scale = 1.0f / m_cellSize;
+    // clamped before converting, the far corners of a cone are well off the grid
+    const int minX = std::max(int(floorf(std::max(lo * scale, float(m_minX)))), m_minX);
+    const int maxX = std::min(int(floorf(std::min(hi * scale, float(m_maxX + 1)))), m_maxX);
+    const float cellArea = m_cellSize * m_cellSize;
+    Vertex slab[kMaxCoverage + 2], scratch[kMaxCoverage + 4], cell[kMaxCoverage + 4];
+    for (int x = minX; x <= maxX; ++x) {
+        const float x0 = float(x) * m_cellSize;
+        int numSlab = ClipAxis(polygon, n, false, x0, true, scratch);
+        numSlab = ClipAxis(scratch, numSlab, false, x0 + m_cellSize, false, slab);
+        if (numSlab < 3) {
+            continue;
+        }
+        float slabLo = FLT_MAX;
+        float slabHi = -FLT_MAX;
+        for (int k = 0; k < numSlab; ++k) {
+            slabLo = std::min(slabLo, slab[k].y);
+            slabHi = std::max(slabHi, slab[k].y);
+        }
+        const int minY = std::max(int(floorf(std::max(slabLo * scale, float(m_minY)))), m_minY);
+        const int maxY = std::min(int(floorf(std::min(slabHi * scale, float(m_maxY + 1)))), m_maxY);
+        const int iX = x + kHalfRange;
+        for (int y = minY; y <= maxY; ++y) {
+            const int iY = y + kHalfRange;
+            uint64_t& word = m_blocked[iX][iY >> 6];
+            const uint64_t bit = uint64_t(1) << (iY & 63);
+            if (word & bit) {
+                continue;
+            }
+            const float y0 = float(y) * m_cellSize;
+            int numCell = ClipAxis(slab, numSlab, true, y0, true, scratch);
+            numCell = ClipAxis(scratch, numCell, true, y0 + m_cellSize, false, cell);
+            float area = 0.0f;
+            for (int k = 0; k < numCell; ++k) {
+                area += Cross(cell[k], cell[k + 1 < numCell ? k + 1 : 0]);
+            }
+            const float coverage = 0.5f * area / cellArea;
+            if (coverage >= kFullCoverage) {
+                m_map[iX][iY] = 0.0f;
+                word |= bit;
+            } else if (coverage > 0.0f) {
+                m_map[iX][iY] *= 1.0f - coverage;
             }
         }
     }
+}
 
+// The part of the polygon on one side of x = value (or y = value), above it or below, returns its size (at most n + 1)
+static int ClipAxis(const Vertex* in, int n, bool alongY, float value, bool keepAbove, Vertex* out)
+{
+    int count = 0;
+    for (int k = 0; k < n; ++k) {
+        const Vertex& a = in[k];
+        const Vertex& b = in[k + 1 < n ? k + 1 : 0];
+        const float da = ((alongY ? a.y : a.x) - value) * (keepAbove ? 1.0f : -1.0f);
+        const float db = ((alongY ? b.y : b.x) - value) * (keepAbove ? 1.0f : -1.0f);
+        if (da >= 0.0f) {
+            out[count++] = a;
+        }
+        if ((da < 0.0f) != (db < 0.0f)) {
+            const float t = da / (da - db);
+            out[count++] = Add(a, Mult(Sub(b, a), t));
+        }
+    }
+    return count;
+}
+
+// Blocks rows y0..y1 of column x a word at a time
+void BlockRun(int x, int y0, int y1)
+{
+    const int iX = x + kHalfRange;
+    const int i0 = y0 + kHalfRange;
+    const int i1 = y1 + kHalfRange;
+    for (int w = i0 >> 6; w <= (i1 >> 6); ++w) {
+        const int lo = std::max(i0, w * 64) - w * 64;
+        const int hi = std::min(i1, w * 64 + 63) - w * 64;
+        const uint64_t mask = (~uint64_t(0) >> (63 - hi)) & (~uint64_t(0) << lo);
+        uint64_t fresh = mask & ~m_blocked[iX][w];
+        m_blocked[iX][w] |= fresh;
+        for (; fresh; fresh &= fresh - 1) {
+            m_map[iX][w * 64 + CountTrailingZeros(fresh)] = 0.0f;
+        }
+    }
 }
 
+// drawTriangle() for a disc against disc cone through its ConeStampTable footprint. Cells certainly inside the
+// cone and far enough past the apex that the obstacle is reached within kTimeCutoff are blocked a run at a time,
+// cells certainly outside or too near the apex are skipped, and only the ones in between get the exact test, so the
+// map comes out as drawTriangle() alone would make it. Returns false, having drawn nothing, if the footprint can't
+// be used: the apex is off the grid, the cone is too wide or the triangle's far edge crosses the grid.
+bool DrawConeStamp(const VelocityObstacle& vo, EdgeEquation& e0, EdgeEquation& e1, EdgeEquation& e2,
+                   int minX, int maxX, int minY, int maxY)
+{
+    const Vec2D& apex = vo.m_apex;
+    if (!(apex.x >= float(-kHalfRange) && apex.x < float(kHalfRange) && apex.y >= float(-kHalfRange) && apex.y < float(kHalfRange))) {
+        return false;
+    }
+    const Vec2D offset = Sub(vo.m_b.position, vo.m_a.position);
+    const float dist = Length(offset);
+    const float r = vo.m_a.radius + vo.m_b.radius;
+    const float sine = r / dist;
+    // the far edge is m_infEdgeLen * cos(half angle) from the apex, nothing on the grid is as far as 2 * kRange
+    if (vo.m_infEdgeLen * sqrtf(std::max(1.0f - sine * sine, 0.0f)) <= float(2 * kRange)) {
+        return false;
+    }
+    bool flipX, flipY;
+    const ConeStampTable::Span* stamp = ConeStampTable::Get().Find(offset, sine, flipX, flipY);
+    if (!stamp) {
+        return false;
+    }
+    const int ax = int(floorf(apex.x));
+    const int ay = int(floorf(apex.y));
+    // inside the cone the obstacle is reached within kTimeCutoff beyond the tangent length and never short of dist - r
+    const float blockedRadius = (sqrtf(std::max(dist * dist - r * r, 0.0f)) + kStampMargin) / kTimeCutoff;
+    const float freeRadius = std::max(dist - r - kStampMargin, 0.0f) / kTimeCutoff;
+    const float blockedRadiusSqr = blockedRadius * blockedRadius;
+    const float freeRadiusSqr = freeRadius * freeRadius;
+
+    for (int x = minX; x <= maxX; ++x) {
+        const int dx = x - ax;
+        const ConeStampTable::Span& span = stamp[(flipX ? -dx : dx) + ConeStampTable::kExtent];
+        int innerLo = flipY ? -span.innerHi : span.innerLo;
+        int innerHi = flipY ? -span.innerLo : span.innerHi;
+        const int outerLo = std::max(ay + (flipY ? -span.outerHi : span.outerLo), minY);
+        const int outerHi = std::min(ay + (flipY ? -span.outerLo : span.outerHi), maxY);
+        innerLo = std::max(ay + innerLo, outerLo);
+        innerHi = std::min(ay + innerHi, outerHi);
+
+        const float wx = float(x) + 0.5f - apex.x;
+        auto exactRows = [&](int y0, int y1) {
+            for (int y = y0; y <= y1; ++y) {
+                const float wy = float(y) + 0.5f - apex.y;
+                if (wx * wx + wy * wy >= freeRadiusSqr) {
+                    DrawCell(vo, e0, e1, e2, x, y);
+                }
+            }
+        };
+        if (innerLo > innerHi) {
+            exactRows(outerLo, outerHi);
+            continue;
+        }
+        exactRows(outerLo, innerLo - 1);
+        if (wx * wx < blockedRadiusSqr) {
+            // the rows with |wy| <= h are too near the apex to be sure of
+            const float h = sqrtf(blockedRadiusSqr - wx * wx);
+            const int below = int(ceilf(apex.y - 0.5f - h)) - 1;
+            const int above = int(floorf(apex.y - 0.5f + h)) + 1;
+            if (innerLo <= std::min(innerHi, below)) {
+                BlockRun(x, innerLo, std::min(innerHi, below));
+            }
+            exactRows(std::max(innerLo, below + 1), std::min(innerHi, above - 1));
+            if (std::max(innerLo, above) <= innerHi) {
+                BlockRun(x, std::max(innerLo, above), innerHi);
+            }
+        } else {
+            BlockRun(x, innerLo, innerHi);
+        }
+        exactRows(innerHi + 1, outerHi);
+    }
+    return true;
+}
 
 };
@@ -0,0 +1,446 @@
+#pragma once
+
+// Binary replay log.
+//
+// A keyframe holds the full state of every vehicle, it is written every kKeyframeInterval ticks.
+// Every other tick is a delta against the previous tick: each float's bit pattern minus the previous one,
+// zigzag varint encoded, so anything that didn't move costs a byte and slow movement 2-3 bytes.
+// On close a footer with the offset of every keyframe is appended. Since keyframes are strictly periodic
+// seeking to any tick is one table lookup plus at most kKeyframeInterval - 1 deltas.
+//
+// file   := Header Frame* [KeyframeTable Footer]
+// Frame  := FrameHeader payload
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "geom.h"
+#include "platform.h"
+
+// what gets recorded for each vehicle every tick
+struct ReplaySample
+{
+    Vec2D   pos;
+    float   rot;
+    Vec2D   velocity;
+    Vec2D   voVelocity;     // velocity picked from the VO map
+};
+
+static const int kReplayFloatsPerSample = sizeof(ReplaySample) / sizeof(float);
+static_assert(sizeof(ReplaySample) == kReplayFloatsPerSample * sizeof(float), "ReplaySample must be plain floats");
+
+struct ReplayFormat
+{
+    static const uint32_t kMagic = 0x50523244;          // "D2RP"
+    static const uint32_t kFooterMagic = 0x58523244;    // "D2RX"
+    static const uint32_t kVersion = 1;
+    static const uint32_t kKeyframeInterval = 60;       // 1s of sim
+
+    enum FrameType : uint32_t {
+        kKeyframe = 1,
+        kDelta = 2,
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t keyframeInterval;
+        uint32_t firstTick;
+    };
+
+    struct FrameHeader {
+        uint32_t type;
+        uint32_t tick;
+        uint32_t count;     // vehicles
+        uint32_t size;      // payload bytes
+    };
+
+    struct Footer {
+        uint64_t tableOffset;
+        uint32_t numKeyframes;
+        uint32_t numTicks;
+        uint32_t magic;
+        uint32_t pad;
+    };
+
+    static inline void PutVarint(std::vector<uint8_t>& out, uint32_t v) {
+        while (v >= 0x80) {
+            out.push_back(uint8_t(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(uint8_t(v));
+    }
+
+    // false if the varint runs past end or past 32 bits
+    static inline bool GetVarint(const uint8_t*& p, const uint8_t* end, uint32_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 32 && p < end; shift += 7) {
+            uint8_t b = *p++;
+            v |= uint32_t(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static inline uint32_t ZigZag(int32_t v) {
+        return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+    }
+
+    static inline int32_t UnZigZag(uint32_t v) {
+        return int32_t(v >> 1) ^ -int32_t(v & 1);
+    }
+};
+
+// Records ticks from the sim thread, all encoding and file IO happens on a background thread.
+// Record() only copies the samples into a recycled buffer and queues it.
+class ReplayWriter {
+public:
+    explicit ReplayWriter(const char* filename)
+    : m_file(OpenFile(filename, "wb"))
+    {
+        if (m_file) {
+            m_thread = std::thread([this]() { WriterLoop(); });
+        }
+    }
+
+    ~ReplayWriter() {
+        Close();
+    }
+
+    bool IsOpen() const { return m_file != nullptr; }
+
+    // ticks must be consecutive
+    void Record(uint32_t tick, const ReplaySample* samples, size_t count) {
+        if (!m_file) {
+            return;
+        }
+        Pending p;
+        p.tick = tick;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_free.empty()) {
+                p.samples.swap(m_free.back());
+                m_free.pop_back();
+            }
+        }
+        p.samples.assign(samples, samples + count);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(std::move(p));
+        }
+        m_wake.notify_one();
+    }
+
+    // flushes everything queued and writes the keyframe table
+    void Close() {
+        if (!m_file) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+
+        ReplayFormat::Footer footer;
+        footer.tableOffset = m_offset;
+        footer.numKeyframes = uint32_t(m_keyframes.size());
+        footer.numTicks = m_numTicks;
+        footer.magic = ReplayFormat::kFooterMagic;
+        footer.pad = 0;
+        if (!m_keyframes.empty()) {
+            fwrite(m_keyframes.data(), sizeof(uint64_t), m_keyframes.size(), m_file);
+        }
+        fwrite(&footer, sizeof(footer), 1, m_file);
+        fclose(m_file);
+        m_file = nullptr;
+    }
+
+private:
+    struct Pending {
+        uint32_t                    tick = 0;
+        std::vector<ReplaySample>   samples;
+    };
+
+    void WriterLoop() {
+        for (;;) {
+            Pending p;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this]() { return m_quit || !m_queue.empty(); });
+                if (m_queue.empty()) {
+                    return; // quit and drained
+                }
+                p = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            Encode(p);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_free.push_back(std::move(p.samples));
+            }
+        }
+    }
+
+    void Encode(const Pending& p) {
+        if (m_numTicks == 0) {
+            m_firstTick = p.tick;
+            ReplayFormat::Header header;
+            header.magic = ReplayFormat::kMagic;
+            header.version = ReplayFormat::kVersion;
+            header.keyframeInterval = ReplayFormat::kKeyframeInterval;
+            header.firstTick = p.tick;
+            fwrite(&header, sizeof(header), 1, m_file);
+            m_offset = sizeof(header);
+        }
+        assert(p.tick == m_firstTick + m_numTicks);
+
+        const bool keyframe = (m_numTicks % ReplayFormat::kKeyframeInterval) == 0;
+        const size_t numFloats = p.samples.size() * kReplayFloatsPerSample;
+        m_cur.resize(numFloats);
+        if (numFloats) {
+            memcpy(m_cur.data(), p.samples.data(), numFloats * sizeof(uint32_t));
+        }
+
+        m_payload.clear();
+        if (keyframe) {
+            m_keyframes.push_back(m_offset);
+            m_payload.resize(numFloats * sizeof(uint32_t));
+            if (numFloats) {
+                memcpy(m_payload.data(), m_cur.data(), numFloats * sizeof(uint32_t));
+            }
+        } else {
+            // vehicles that didn't exist last tick delta against zero
+            for (size_t i = 0; i < numFloats; ++i) {
+                uint32_t prev = i < m_prev.size() ? m_prev[i] : 0;
+                int32_t delta = int32_t(m_cur[i] - prev);
+                ReplayFormat::PutVarint(m_payload, ReplayFormat::ZigZag(delta));
+            }
+        }
+        m_prev.swap(m_cur);
+
+        ReplayFormat::FrameHeader fh;
+        fh.type = keyframe ? ReplayFormat::kKeyframe : ReplayFormat::kDelta;
+        fh.tick = p.tick;
+        fh.count = uint32_t(p.samples.size());
+        fh.size = uint32_t(m_payload.size());
+        fwrite(&fh, sizeof(fh), 1, m_file);
+        if (!m_payload.empty()) {
+            fwrite(m_payload.data(), 1, m_payload.size(), m_file);
+        }
+        m_offset += sizeof(fh) + m_payload.size();
+        ++m_numTicks;
+    }
+
+    FILE*                               m_file;
+    std::thread                         m_thread;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_wake;
+    std::deque<Pending>                 m_queue;
+    std::vector<std::vector<ReplaySample>> m_free;  // recycled sample buffers
+    bool                                m_quit = false;
+
+    // writer thread only
+    uint64_t                            m_offset = 0;
+    uint32_t                            m_firstTick = 0;
+    uint32_t                            m_numTicks = 0;
+    std::vector<uint64_t>               m_keyframes;
+    std::vector<uint32_t>               m_prev;     // float bits of the previous tick
+    std::vector<uint32_t>               m_cur;
+    std::vector<uint8_t>                m_payload;
+};
+
+// Memory maps a replay and decodes any tick on demand. Nothing read from the file is trusted: the footer and
+// keyframe table are checked on Open() and every frame against the end of the frames as it is decoded, so a
+// truncated or corrupt file fails to seek rather than reading outside the mapping.
+class ReplayReader {
+public:
+    bool Open(const char* filename) {
+        Close();
+        if (!m_map.Open(filename) || m_map.Size() < sizeof(ReplayFormat::Header)) {
+            return false;
+        }
+        ReplayFormat::Header header;
+        memcpy(&header, m_map.Data(), sizeof(header));
+        if (header.magic != ReplayFormat::kMagic || header.version != ReplayFormat::kVersion || header.keyframeInterval == 0) {
+            m_map.Close();
+            return false;
+        }
+        m_firstTick = header.firstTick;
+        m_keyframeInterval = header.keyframeInterval;
+
+        if (!ReadFooter()) {
+            m_keyframes.clear();
+            m_numTicks = 0;
+            RebuildIndex();
+        }
+        return true;
+    }
+
+    void Close() {
+        m_map.Close();
+        m_keyframes.clear();
+        m_numTicks = 0;
+        m_framesEnd = 0;
+        m_decodedTick = -1;
+    }
+
+    bool IsOpen() const { return m_map.IsOpen(); }
+    uint32_t FirstTick() const { return m_firstTick; }
+    uint32_t NumTicks() const { return m_numTicks; }
+
+    // Decode the state at tick (absolute, FirstTick() .. FirstTick() + NumTicks() - 1).
+    // Stepping forward one tick at a time only decodes the new delta.
+    bool Seek(uint32_t tick, std::vector<ReplaySample>& out) {
+        if (tick < m_firstTick || uint64_t(tick) >= uint64_t(m_firstTick) + m_numTicks) {
+            return false;
+        }
+        const uint32_t rel = tick - m_firstTick;
+        const uint32_t key = rel / m_keyframeInterval;
+        const uint32_t keyTick = key * m_keyframeInterval;
+        if (key >= m_keyframes.size()) {
+            return false;
+        }
+
+        uint32_t from;
+        if (m_decodedTick >= int64_t(keyTick) && m_decodedTick <= int64_t(rel)) {
+            from = uint32_t(m_decodedTick) + 1;
+        } else {
+            m_cursor = m_keyframes[key];
+            m_decodedTick = -1;
+            if (!DecodeFrame(ReplayFormat::kKeyframe)) {
+                return false;
+            }
+            from = keyTick + 1;
+        }
+        for (uint32_t t = from; t <= rel; ++t) {
+            if (!DecodeFrame(ReplayFormat::kDelta)) {
+                m_decodedTick = -1;
+                return false;
+            }
+        }
+        m_decodedTick = rel;
+
+        out.resize(m_state.size() / kReplayFloatsPerSample);
+        if (!out.empty()) {
+            memcpy(static_cast<void*>(out.data()), m_state.data(), m_state.size() * sizeof(uint32_t));
+        }
+        return true;
+    }
+
+private:
+    // The table has to sit between the frames and the footer, hold one keyframe per keyframe interval of
+    // numTicks, and point at keyframe headers whose payload ends before the table. False falls back to RebuildIndex().
+    bool ReadFooter() {
+        const uint64_t size = m_map.Size();
+        if (size < sizeof(ReplayFormat::Header) + sizeof(ReplayFormat::Footer)) {
+            return false;
+        }
+        ReplayFormat::Footer footer;
+        memcpy(&footer, m_map.Data() + size - sizeof(footer), sizeof(footer));
+        const uint64_t tableSpace = size - sizeof(footer) - sizeof(ReplayFormat::Header);
+        const uint64_t expectedKeyframes = (uint64_t(footer.numTicks) + m_keyframeInterval - 1) / m_keyframeInterval;
+        if (footer.magic != ReplayFormat::kFooterMagic || footer.numKeyframes > tableSpace / sizeof(uint64_t) ||
+            footer.tableOffset != size - sizeof(footer) - uint64_t(footer.numKeyframes) * sizeof(uint64_t) ||
+            footer.numKeyframes != expectedKeyframes) {
+            return false;
+        }
+        m_framesEnd = footer.tableOffset;
+        m_keyframes.resize(footer.numKeyframes);
+        if (footer.numKeyframes) {
+            memcpy(m_keyframes.data(), m_map.Data() + footer.tableOffset, footer.numKeyframes * sizeof(uint64_t));
+        }
+        for (uint64_t offset : m_keyframes) {
+            ReplayFormat::FrameHeader fh;
+            if (!ReadFrameHeader(offset, fh) || fh.type != ReplayFormat::kKeyframe) {
+                return false;
+            }
+        }
+        m_numTicks = footer.numTicks;
+        return true;
+    }
+
+    // Recording was cut short, walk the frame headers to find the keyframes. Stops at the first frame that is
+    // cut off or out of the keyframe pattern, everything before it can still be played.
+    void RebuildIndex() {
+        m_framesEnd = m_map.Size();
+        uint64_t offset = sizeof(ReplayFormat::Header);
+        ReplayFormat::FrameHeader fh;
+        while (ReadFrameHeader(offset, fh)) {
+            const bool keyframe = (m_numTicks % m_keyframeInterval) == 0;
+            if (fh.type != (keyframe ? ReplayFormat::kKeyframe : ReplayFormat::kDelta)) {
+                break;
+            }
+            if (keyframe) {
+                m_keyframes.push_back(offset);
+            }
+            ++m_numTicks;
+            offset += sizeof(fh) + fh.size;
+        }
+    }
+
+    // false unless a whole frame, header and payload, fits before m_framesEnd at offset
+    bool ReadFrameHeader(uint64_t offset, ReplayFormat::FrameHeader& fh) const {
+        if (offset < sizeof(ReplayFormat::Header) || offset > m_framesEnd || m_framesEnd - offset < sizeof(fh)) {
+            return false;
+        }
+        memcpy(&fh, m_map.Data() + offset, sizeof(fh));
+        return fh.size <= m_framesEnd - offset - sizeof(fh);
+    }
+
+    bool DecodeFrame(ReplayFormat::FrameType type) {
+        ReplayFormat::FrameHeader fh;
+        if (!ReadFrameHeader(m_cursor, fh) || fh.type != type) {
+            return false;
+        }
+        const uint8_t* p = m_map.Data() + m_cursor + sizeof(fh);
+        const uint8_t* end = p + fh.size;
+        const size_t numFloats = size_t(fh.count) * kReplayFloatsPerSample;
+        if (fh.type == ReplayFormat::kKeyframe) {
+            if (fh.size != uint64_t(fh.count) * sizeof(ReplaySample)) {
+                return false;
+            }
+            m_state.resize(numFloats);
+            if (numFloats) {
+                memcpy(m_state.data(), p, numFloats * sizeof(uint32_t));
+            }
+        } else {
+            // every delta is at least a byte
+            if (fh.count > fh.size / kReplayFloatsPerSample) {
+                return false;
+            }
+            m_state.resize(numFloats, 0);
+            for (size_t i = 0; i < numFloats; ++i) {
+                uint32_t v;
+                if (!ReplayFormat::GetVarint(p, end, v)) {
+                    return false;
+                }
+                m_state[i] += uint32_t(ReplayFormat::UnZigZag(v));
+            }
+        }
+        m_cursor += sizeof(fh) + fh.size;
+        return true;
+    }
+
+    MappedFile              m_map;
+    uint32_t                m_firstTick = 0;
+    uint32_t                m_keyframeInterval = ReplayFormat::kKeyframeInterval;
+    uint32_t                m_numTicks = 0;
+    std::vector<uint64_t>   m_keyframes;
+    uint64_t                m_framesEnd = 0;    // the keyframe table, or the end of a file without one
+
+    // decode state, relative tick of m_state and where the next frame starts
+    int64_t                 m_decodedTick = -1;
+    uint64_t                m_cursor = 0;
+    std::vector<uint32_t>   m_state;
+};
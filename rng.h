@@ -0,0 +1,174 @@
+#pragma once
+
+// Counter based random numbers, Philox4x32-10 from
+// https://www.thesalmons.org/john/random123/papers/random123sc11.pdf
+// Every value is a pure function of (key, counter), there is no hidden state to share between threads,
+// so any vehicle on any thread can draw its numbers in any order and a run still replays bit-identically.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+struct Philox4x32
+{
+    struct Counter { uint32_t v[4]; };
+    struct Key { uint32_t v[2]; };
+
+    static const int kRounds = 10;
+    static const uint32_t kMul0 = 0xD2511F53;
+    static const uint32_t kMul1 = 0xCD9E8D57;
+    static const uint32_t kWeyl0 = 0x9E3779B9;
+    static const uint32_t kWeyl1 = 0xBB67AE85;
+
+    static inline Counter Generate(Counter ctr, Key key) {
+        for (int r = 0; r < kRounds; ++r) {
+            uint64_t p0 = uint64_t(kMul0) * ctr.v[0];
+            uint64_t p1 = uint64_t(kMul1) * ctr.v[2];
+            Counter next;
+            next.v[0] = uint32_t(p1 >> 32) ^ ctr.v[1] ^ key.v[0];
+            next.v[1] = uint32_t(p1);
+            next.v[2] = uint32_t(p0 >> 32) ^ ctr.v[3] ^ key.v[1];
+            next.v[3] = uint32_t(p0);
+            ctr = next;
+            key.v[0] += kWeyl0;
+            key.v[1] += kWeyl1;
+        }
+        return ctr;
+    }
+
+    // Generate numBlocks consecutive blocks (4 values each) starting at base, incrementing counter word 0.
+    // Blocks are processed kLanes at a time with the lanes in separate arrays so the rounds
+    // compile down to SIMD multiplies instead of one 64 bit multiply per value.
+    static void GenerateBlocks(const Counter& base, const Key& key, uint32_t* out, size_t numBlocks) {
+        const int kLanes = 8;
+        size_t block = 0;
+        for (; block + kLanes <= numBlocks; block += kLanes) {
+            uint32_t c0[kLanes], c1[kLanes], c2[kLanes], c3[kLanes];
+            for (int l = 0; l < kLanes; ++l) {
+                c0[l] = base.v[0] + uint32_t(block) + uint32_t(l);
+                c1[l] = base.v[1];
+                c2[l] = base.v[2];
+                c3[l] = base.v[3];
+            }
+            uint32_t k0 = key.v[0];
+            uint32_t k1 = key.v[1];
+            for (int r = 0; r < kRounds; ++r) {
+                for (int l = 0; l < kLanes; ++l) {
+                    uint64_t p0 = uint64_t(kMul0) * c0[l];
+                    uint64_t p1 = uint64_t(kMul1) * c2[l];
+                    uint32_t n0 = uint32_t(p1 >> 32) ^ c1[l] ^ k0;
+                    uint32_t n2 = uint32_t(p0 >> 32) ^ c3[l] ^ k1;
+                    c1[l] = uint32_t(p1);
+                    c3[l] = uint32_t(p0);
+                    c0[l] = n0;
+                    c2[l] = n2;
+                }
+                k0 += kWeyl0;
+                k1 += kWeyl1;
+            }
+            for (int l = 0; l < kLanes; ++l) {
+                uint32_t* o = out + 4 * (block + l);
+                o[0] = c0[l];
+                o[1] = c1[l];
+                o[2] = c2[l];
+                o[3] = c3[l];
+            }
+        }
+        // tail
+        for (; block < numBlocks; ++block) {
+            Counter c = base;
+            c.v[0] += uint32_t(block);
+            Counter r = Generate(c, key);
+            for (int i = 0; i < 4; ++i) {
+                out[4 * block + i] = r.v[i];
+            }
+        }
+    }
+};
+
+// [0, 1) with 24 bits of mantissa
+static inline float U32ToFloat01(uint32_t x) {
+    return float(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// A reproducible stream of random numbers for one (seed, run, vehicle, tick).
+// Cheap to construct, create one wherever numbers are needed instead of passing generators around.
+class RandomStream {
+public:
+    RandomStream(uint64_t seed, uint32_t runId, uint32_t vehicleId, uint32_t tick)
+    : m_used(4)
+    {
+        m_key.v[0] = uint32_t(seed);
+        m_key.v[1] = uint32_t(seed >> 32);
+        m_ctr.v[0] = 0;     // draw index, bumped per block
+        m_ctr.v[1] = tick;
+        m_ctr.v[2] = vehicleId;
+        m_ctr.v[3] = runId;
+    }
+
+    uint32_t NextU32() {
+        if (m_used == 4) {
+            Philox4x32::Counter r = Philox4x32::Generate(m_ctr, m_key);
+            for (int i = 0; i < 4; ++i) {
+                m_buffer[i] = r.v[i];
+            }
+            ++m_ctr.v[0];
+            m_used = 0;
+        }
+        return m_buffer[m_used++];
+    }
+
+    float NextFloat() {
+        return U32ToFloat01(NextU32());
+    }
+
+    float NextFloat(float lo, float hi) {
+        return lo + (hi - lo) * NextFloat();
+    }
+
+    // Box-Muller, one value per call, the second value is thrown away to keep the stream position simple
+    float NextGaussian(float mean = 0.0f, float sigma = 1.0f) {
+        float u1 = 1.0f - NextFloat(); // (0, 1]
+        float u2 = NextFloat();
+        float mag = sqrtf(-2.0f * logf(u1));
+        return mean + sigma * mag * cosf(2.0f * float(M_PI) * u2);
+    }
+
+    // Bulk generation, whole blocks go straight through the vectorized path.
+    // Values already buffered from NextU32() are used first so mixing the two keeps the sequence identical.
+    void FillU32(uint32_t* out, size_t n) {
+        size_t i = 0;
+        while (i < n && m_used < 4) {
+            out[i++] = m_buffer[m_used++];
+        }
+        size_t numBlocks = (n - i) / 4;
+        if (numBlocks > 0) {
+            Philox4x32::GenerateBlocks(m_ctr, m_key, out + i, numBlocks);
+            m_ctr.v[0] += uint32_t(numBlocks);
+            i += numBlocks * 4;
+        }
+        while (i < n) {
+            out[i++] = NextU32();
+        }
+    }
+
+    void FillFloat(float* out, size_t n) {
+        const size_t kChunk = 256;
+        uint32_t bits[kChunk];
+        for (size_t i = 0; i < n; i += kChunk) {
+            size_t count = (n - i < kChunk) ? n - i : kChunk;
+            FillU32(bits, count);
+            for (size_t j = 0; j < count; ++j) {
+                out[i + j] = U32ToFloat01(bits[j]);
+            }
+        }
+    }
+
+private:
+    Philox4x32::Key     m_key;
+    Philox4x32::Counter m_ctr;
+    uint32_t            m_buffer[4];
+    int                 m_used;
+};
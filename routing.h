@@ -0,0 +1,222 @@
+#pragma once
+
+// Lane level routing. LaneGraph holds which lanes lead into, run beside and cross which; RouteTable answers
+// "which lane next to get from lane a to lane b" with one table read, and keeps that table current as lanes
+// are blocked and reopened by re-solving only the destinations whose routes change.
+
+#include <float.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+struct LaneEdge
+{
+    enum Kind : uint8_t {
+        kSuccessor,     // from's end runs into to's start
+        kAdjacent,      // side by side in the same direction, a lane change
+        kConflict,      // paths cross or merge, never followed by routing
+    };
+
+    uint8_t from;
+    uint8_t to;
+    Kind    kind;
+    float   cost;       // m, length of from for successors, kLaneChangeCost for adjacent lanes
+};
+
+// Lanes are nodes 0..NumLanes()-1 (at most 256), edges kept sorted by from with both out and in ranges for each node.
+class LaneGraph {
+public:
+    static constexpr float kLaneChangeCost = 30.0f;     // m of driving a lane change is worth avoiding
+
+    void Build(size_t numLanes, std::vector<LaneEdge> edges) {
+        std::sort(edges.begin(), edges.end(), [](const LaneEdge& a, const LaneEdge& b) {
+            return a.from != b.from ? a.from < b.from : (a.kind != b.kind ? a.kind < b.kind : a.to < b.to);
+        });
+        edges.erase(std::unique(edges.begin(), edges.end(), [](const LaneEdge& a, const LaneEdge& b) {
+            return a.from == b.from && a.to == b.to && a.kind == b.kind;
+        }), edges.end());
+        m_edges = std::move(edges);
+        m_out.assign(numLanes + 1, 0);
+        m_in.assign(numLanes + 1, 0);
+        m_incoming.clear();
+        for (const auto& e : m_edges) {
+            ++m_out[e.from + 1];
+            ++m_in[e.to + 1];
+        }
+        for (size_t i = 0; i < numLanes; ++i) {
+            m_out[i + 1] += m_out[i];
+            m_in[i + 1] += m_in[i];
+        }
+        m_incoming.resize(m_edges.size());
+        std::vector<uint32_t> fill(m_in.begin(), m_in.end() - 1);
+        for (uint32_t i = 0; i < m_edges.size(); ++i) {
+            m_incoming[fill[m_edges[i].to]++] = i;
+        }
+    }
+
+    size_t NumLanes() const { return m_out.empty() ? 0 : m_out.size() - 1; }
+    const std::vector<LaneEdge>& Edges() const { return m_edges; }
+
+    // fn(const LaneEdge&) for every edge out of lane
+    template<typename Fn>
+    void ForEachOut(uint8_t lane, const Fn& fn) const {
+        for (uint32_t i = m_out[lane]; i < m_out[lane + 1]; ++i) {
+            fn(m_edges[i]);
+        }
+    }
+
+    // fn(const LaneEdge&) for every edge into lane
+    template<typename Fn>
+    void ForEachIn(uint8_t lane, const Fn& fn) const {
+        for (uint32_t i = m_in[lane]; i < m_in[lane + 1]; ++i) {
+            fn(m_edges[m_incoming[i]]);
+        }
+    }
+
+    bool Conflicts(uint8_t a, uint8_t b) const {
+        bool found = false;
+        ForEachOut(a, [&](const LaneEdge& e) {
+            found |= e.kind == LaneEdge::kConflict && e.to == b;
+        });
+        return found;
+    }
+
+private:
+    std::vector<LaneEdge>   m_edges;
+    std::vector<uint32_t>   m_out;      // m_edges[m_out[lane] .. m_out[lane + 1]) leave lane
+    std::vector<uint32_t>   m_in;       // m_incoming[m_in[lane] .. m_in[lane + 1]) enter lane
+    std::vector<uint32_t>   m_incoming; // edge indices grouped by to
+};
+
+// All pairs next hop over the successor and adjacent edges, one shortest path tree per destination.
+// A blocked lane can't be entered but a vehicle already in it can still route out.
+// Lane 0 is never a lane (it is "no lane" in the lane map), so it doubles as "no route". The graph must outlive the table.
+class RouteTable {
+public:
+    static const uint8_t kNoRoute = 0;
+
+    void Build(const LaneGraph& graph) {
+        m_graph = &graph;
+        m_numLanes = graph.NumLanes();
+        m_next.assign(m_numLanes * m_numLanes, uint8_t(kNoRoute));
+        m_dist.assign(m_numLanes * m_numLanes, FLT_MAX);
+        m_blocked.assign(m_numLanes, 0);
+        for (size_t d = 0; d < m_numLanes; ++d) {
+            Solve(uint8_t(d));
+        }
+    }
+
+    size_t NumLanes() const { return m_numLanes; }
+
+    // the lane to move into next on the way from one lane to another, to itself once there, kNoRoute if unreachable
+    uint8_t NextHop(uint8_t from, uint8_t to) const {
+        return (from < m_numLanes && to < m_numLanes) ? m_next[size_t(to) * m_numLanes + from] : kNoRoute;
+    }
+
+    // m along the route, FLT_MAX if unreachable
+    float Distance(uint8_t from, uint8_t to) const {
+        return (from < m_numLanes && to < m_numLanes) ? m_dist[size_t(to) * m_numLanes + from] : FLT_MAX;
+    }
+
+    bool IsBlocked(uint8_t lane) const {
+        return lane < m_numLanes && m_blocked[lane];
+    }
+
+    // Re-solves only the destinations whose routes went through the lane, returns how many
+    size_t Block(uint8_t lane) {
+        if (lane >= m_numLanes || m_blocked[lane]) {
+            return 0;
+        }
+        m_blocked[lane] = 1;
+        size_t solved = 0;
+        for (size_t d = 0; d < m_numLanes; ++d) {
+            const uint8_t* next = &m_next[d * m_numLanes];
+            bool affected = d == lane;
+            for (size_t v = 0; v < m_numLanes && !affected; ++v) {
+                affected = v != lane && next[v] == lane;
+            }
+            if (affected) {
+                Solve(uint8_t(d));
+                ++solved;
+            }
+        }
+        return solved;
+    }
+
+    // Re-solves only the destinations some lane now reaches at least as cheaply through the reopened one
+    size_t Unblock(uint8_t lane) {
+        if (lane >= m_numLanes || !m_blocked[lane]) {
+            return 0;
+        }
+        m_blocked[lane] = 0;
+        size_t solved = 0;
+        for (size_t d = 0; d < m_numLanes; ++d) {
+            const float* dist = &m_dist[d * m_numLanes];
+            // ties count too so the result matches a full Build() exactly
+            bool affected = d == lane;
+            if (!affected && dist[lane] != FLT_MAX) {
+                m_graph->ForEachIn(lane, [&](const LaneEdge& e) {
+                    affected |= IsRouted(e) && dist[lane] + e.cost <= dist[e.from];
+                });
+            }
+            if (affected) {
+                Solve(uint8_t(d));
+                ++solved;
+            }
+        }
+        return solved;
+    }
+
+private:
+    static bool IsRouted(const LaneEdge& e) {
+        return e.kind == LaneEdge::kSuccessor || e.kind == LaneEdge::kAdjacent;
+    }
+
+    // Dijkstra backwards from dest, ties broken by lane id so the table only depends on the graph
+    void Solve(uint8_t dest) {
+        uint8_t* next = &m_next[size_t(dest) * m_numLanes];
+        float* dist = &m_dist[size_t(dest) * m_numLanes];
+        std::fill(next, next + m_numLanes, uint8_t(kNoRoute));
+        std::fill(dist, dist + m_numLanes, FLT_MAX);
+        next[dest] = dest;
+        dist[dest] = 0.0f;
+        if (m_blocked[dest]) {
+            return;
+        }
+        typedef std::pair<float, uint8_t> Item;
+        std::priority_queue<Item, std::vector<Item>, std::greater<Item>> open;
+        open.push(Item(0.0f, dest));
+        while (!open.empty()) {
+            const Item item = open.top();
+            open.pop();
+            const uint8_t v = item.second;
+            if (item.first > dist[v]) {
+                continue;
+            }
+            if (m_blocked[v]) {
+                continue;   // reached, but nothing may route through it
+            }
+            m_graph->ForEachIn(v, [&](const LaneEdge& e) {
+                if (!IsRouted(e)) {
+                    return;
+                }
+                const float d = dist[v] + e.cost;
+                if (d < dist[e.from] || (d == dist[e.from] && v < next[e.from])) {
+                    dist[e.from] = d;
+                    next[e.from] = v;
+                    open.push(Item(d, e.from));
+                }
+            });
+        }
+    }
+
+    const LaneGraph*        m_graph = nullptr;
+    size_t                  m_numLanes = 0;
+    std::vector<uint8_t>    m_next;     // [dest * numLanes + from]
+    std::vector<float>      m_dist;     // same layout
+    std::vector<uint8_t>    m_blocked;
+};
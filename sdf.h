@@ -0,0 +1,108 @@
+#pragma once
+
+// Signed distance fields over a binary mask using the linear time exact Euclidean distance transform from
+// Felzenszwalb & Huttenlocher, "Distance Transforms of Sampled Functions" (2012).
+// The 2D transform is a 1D transform down every column then along every row, each line is independent
+// so both passes are split across the thread pool.
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "parallel.h"
+
+static const float kEdtInf = 1e20f;
+
+// Squared distance transform of f (n samples) into d. v and z are scratch of n and n + 1 elements.
+static inline void DistanceTransform1D(const float* f, int n, float* d, int* v, float* z)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -kEdtInf;
+    z[1] = kEdtInf;
+    for (int q = 1; q < n; ++q) {
+        // where the parabola from q crosses the rightmost one in the lower envelope,
+        // pop parabolas it hides completely (z[0] = -inf stops this at the first one)
+        float s;
+        for (;;) {
+            const int p = v[k];
+            s = ((f[q] + float(q) * float(q)) - (f[p] + float(p) * float(p))) / float(2 * q - 2 * p);
+            if (s > z[k]) {
+                break;
+            }
+            --k;
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = kEdtInf;
+    }
+    k = 0;
+    for (int q = 0; q < n; ++q) {
+        while (z[k + 1] < float(q)) {
+            ++k;
+        }
+        const float dq = float(q - v[k]);
+        d[q] = dq * dq + f[v[k]];
+    }
+}
+
+// Squared distance (in pixels) from every pixel to the nearest pixel where mask == target.
+static inline void SquaredDistanceTransform(const uint8_t* mask, uint8_t target, int width, int height, ThreadPool& pool, std::vector<float>& out)
+{
+    out.resize(size_t(width) * size_t(height));
+    for (size_t i = 0; i < out.size(); ++i) {
+        out[i] = (mask[i] == target) ? 0.0f : kEdtInf;
+    }
+
+    const int maxDim = std::max(width, height);
+    const size_t kLinesPerJob = 16;
+
+    // columns, gathered into scratch so the 1D pass runs on contiguous memory
+    pool.ParallelFor(size_t(width), kLinesPerJob, [&](size_t begin, size_t end, unsigned) {
+        std::vector<float> f(maxDim), d(maxDim), z(maxDim + 1);
+        std::vector<int> v(maxDim);
+        for (size_t x = begin; x < end; ++x) {
+            for (int y = 0; y < height; ++y) {
+                f[y] = out[size_t(y) * width + x];
+            }
+            DistanceTransform1D(f.data(), height, d.data(), v.data(), z.data());
+            for (int y = 0; y < height; ++y) {
+                out[size_t(y) * width + x] = d[y];
+            }
+        }
+    });
+
+    // rows
+    pool.ParallelFor(size_t(height), kLinesPerJob, [&](size_t begin, size_t end, unsigned) {
+        std::vector<float> f(maxDim), z(maxDim + 1);
+        std::vector<int> v(maxDim);
+        for (size_t y = begin; y < end; ++y) {
+            float* row = &out[y * width];
+            std::copy(row, row + width, f.begin());
+            DistanceTransform1D(f.data(), width, row, v.data(), z.data());
+        }
+    });
+}
+
+// Signed distance in pixels to the boundary of the mask, negative inside (mask != 0) and positive outside.
+// Distances are between pixel centres, the boundary is taken to be half a pixel out from the last inside pixel.
+static inline void BuildSignedDistanceField(const uint8_t* mask, int width, int height, ThreadPool& pool, std::vector<float>& out)
+{
+    std::vector<float> toInside;
+    SquaredDistanceTransform(mask, 1, width, height, pool, toInside);
+    SquaredDistanceTransform(mask, 0, width, height, pool, out);   // distance to outside
+
+    const size_t count = out.size();
+    pool.ParallelFor(count, 64 * 1024, [&](size_t begin, size_t end, unsigned) {
+        for (size_t i = begin; i < end; ++i) {
+            if (mask[i]) {
+                out[i] = 0.5f - sqrtf(out[i]);
+            } else {
+                out[i] = sqrtf(toInside[i]) - 0.5f;
+            }
+        }
+    });
+}
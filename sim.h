@@ -1,27 +1,275 @@
 #pragma once
 
+#include <stdint.h>
+#include <string.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#include "assets.h"
+#include "bvh.h"
+#include "contour.h"
+#include "cow.h"
+#include "eventlog.h"
+#include "json5.h"
+#include "mapfile.h"
+#include "parallel.h"
 #include "rasterizer.h"
+#include "replay.h"
+#include "rng.h"
+#include "routing.h"
+#include "sdf.h"
+#include "tiles.h"
+
+
+// FNV-1a style mixing a word at a time, the exact bits of floats go in so any divergence shows up
+static const uint64_t kHashOffset = 0xcbf29ce484222325ull;
+static const uint64_t kHashPrime = 0x100000001b3ull;
+
+static inline uint64_t HashWord(uint64_t h, uint32_t word) {
+    return (h ^ word) * kHashPrime;
+}
 
+static inline uint64_t HashFloat(uint64_t h, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return HashWord(h, bits);
+}
+
+static const char* const kDefaultMap = "./scenarios/straight/road.png";
 
 class DriveableArea {
 public:
-    GLuint m_tex;
-    int width, height, channels;
+    // created on first Render() so maps can be loaded, and compiled, without a GL context
+    mutable GLuint m_tex = 0;
+    int width = 0, height = 0, channels = 0;
+
+    // CPU side layers, one entry per pixel, row 0 is world y = 0 and a pixel is a metre.
+    // Built from the image, or views straight into a compiled map.
+    MapLayer<uint8_t>       m_rgba;
+    MapLayer<uint8_t>       m_driveable;    // 1 on the road
+    MapLayer<uint8_t>       m_coverageMips; // fraction of road 0..255 per pixel, then per 2x2, 4x4 ... down to 1x1
+    MapLayer<float>         m_sdf;          // metres to the road edge, negative on the road
+    MapLayer<uint8_t>       m_trees;        // 1 on a tree
+
+    // road and tree outlines simplified to within kEdgeTolerance, and the same outlines cut into short segments for queries
+    std::vector<Polyline>   m_boundaries;
+    SegmentBvh              m_edges;
+
+    static constexpr float kEdgeTolerance = 0.5f;   // m
+    static constexpr float kMaxEdgeLength = 10.0f;  // m, short pieces keep each static VO cone narrow
+    static constexpr float kMinIslandArea = 10.0f;  // m^2
+    static const size_t kMaxTreeArea = 2000;        // m^2, bigger islands are ground cover
 
-    DriveableArea() {
-        m_tex = glInitTexture();
+    // Tiled maps build the layers a tile at a time, from the tile plus this much of its neighbours so distances
+    // and outlines near the tile border come out the same as for the whole image
+    static const int kRoadTilePadding = 64;         // m
+    static const size_t kRoadTileCapacity = 64;     // built tiles kept, least recently used go first
+
+    // World position of pixel (0, 0), non zero only for the tiles of a tiled map
+    Vec2D                   m_origin = Vec2D(0.0f, 0.0f);
+
+    // an image is decoded and every layer built from it, a .d2map is mapped as is, a .d2tiles is built per tile as needed
+    explicit DriveableArea(ThreadPool& pool, const char* filename = kDefaultMap) {
+        const size_t len = strlen(filename);
+        if (len > 6 && strcmp(filename + len - 6, ".d2map") == 0) {
+            m_loaded = LoadCompiled(filename);
+        } else if (IsTiledFilename(filename)) {
+            m_loaded = LoadTiled(filename);
+        } else {
+            m_loaded = LoadImage(filename, pool);
+        }
     }
 
-    GLuint glInitTexture()
-    {
-        GLuint t = 0;
-        const char* filename = "./scenarios/straight/road.png";
+    // One tile of a tiled map: the simulation layers of w x h pixels of RGBA whose pixel (0, 0) is at origin.
+    // Only what queries need is kept, the image and coverage mips aren't.
+    DriveableArea(const uint8_t* rgba, int w, int h, const Vec2D& origin) {
+        width = w;
+        height = h;
+        channels = 4;
+        m_origin = origin;
+        ThreadPool serial(1);   // tiles are built on whichever thread asks, often one of the simulation's pool
+        BuildDriveable(rgba);
+        BuildTrees(rgba);
+        std::vector<float> sdf;
+        BuildSignedDistanceField(m_driveable.data(), width, height, serial, sdf);
+        m_sdf.Assign(std::move(sdf));
+        BuildEdges();
+        m_driveable.Assign(std::vector<uint8_t>());
+        m_trees.Assign(std::vector<uint8_t>());
+        m_loaded = true;
+    }
+
+    DriveableArea(const DriveableArea&) = delete;
+    DriveableArea& operator=(const DriveableArea&) = delete;
+
+    bool IsLoaded() const { return m_loaded; }
+
+    bool LoadImage(const char* filename, ThreadPool& pool) {
         unsigned char *data = stbi_load(filename, &width, &height, &channels, 4);
-        assert(data);
+        if (!data) {
+            return false;
+        }
         //assert(channels == 4); // passing 4 forces func to return 4 components per pixel
+        m_rgba.Assign(std::vector<uint8_t>(data, data + size_t(width) * size_t(height) * 4));
+        stbi_image_free(data);
+
+        BuildDriveable(m_rgba.data());
+        BuildCoverageMips();
+        BuildTrees(m_rgba.data());
+        std::vector<float> sdf;
+        BuildSignedDistanceField(m_driveable.data(), width, height, pool, sdf);
+        m_sdf.Assign(std::move(sdf));
+        BuildEdges();
+        return true;
+    }
+
+    // Zero copy apart from the outlines and edge tree, which are small
+    bool LoadCompiled(const char* filename) {
+        if (!m_file.Open(filename)) {
+            return false;
+        }
+        // the header comes from the file, every section size below has to fit in a size_t
+        const uint32_t w = m_file.Width();
+        const uint32_t h = m_file.Height();
+        if (w == 0 || h == 0 || w > uint32_t(INT32_MAX) || h > uint32_t(INT32_MAX) ||
+            uint64_t(w) * uint64_t(h) > uint64_t(SIZE_MAX / (2 * sizeof(float)))) {
+            m_file.Close();
+            return false;
+        }
+        width = int(w);
+        height = int(h);
+        channels = 4;
+        const size_t count = size_t(width) * size_t(height);
+        const uint8_t* rgba = m_file.Array<uint8_t>(MapFormat::kRgba, count * 4);
+        const uint8_t* driveable = m_file.Array<uint8_t>(MapFormat::kOccupancy, count);
+        const uint8_t* mips = m_file.Array<uint8_t>(MapFormat::kOccupancyMips, CoverageMipsSize(width, height));
+        const float* sdf = m_file.Array<float>(MapFormat::kSdf, count);
+        const uint8_t* trees = m_file.Array<uint8_t>(MapFormat::kTrees, count);
+        size_t boundariesSize, segmentsSize, nodesSize;
+        const uint8_t* boundaries = static_cast<const uint8_t*>(m_file.Section(MapFormat::kBoundaries, boundariesSize));
+        const void* segments = m_file.Section(MapFormat::kEdgeSegments, segmentsSize);
+        const void* nodes = m_file.Section(MapFormat::kEdgeNodes, nodesSize);
+        if (!rgba || !driveable || !mips || !sdf || !trees || !boundaries || !segments || !nodes ||
+            segmentsSize % sizeof(Segment) != 0 || nodesSize % sizeof(SegmentBvh::Node) != 0 ||
+            !ReadBoundaries(boundaries, boundariesSize)) {
+            m_file.Close();
+            return false;
+        }
+        m_rgba.View(rgba, count * 4);
+        m_driveable.View(driveable, count);
+        m_coverageMips.View(mips, CoverageMipsSize(width, height));
+        m_sdf.View(sdf, count);
+        m_trees.View(trees, count);
+        m_edges.Assign(static_cast<const Segment*>(segments), segmentsSize / sizeof(Segment),
+            static_cast<const SegmentBvh::Node*>(nodes), nodesSize / sizeof(SegmentBvh::Node));
+        return true;
+    }
+
+    // Only the tile table is read here, RoadTile() builds each tile's layers the first time something asks there
+    bool LoadTiled(const char* filename) {
+        if (!m_tiled.Open(filename)) {
+            return false;
+        }
+        width = int(m_tiled.Header().width);
+        height = int(m_tiled.Header().height);
+        channels = 4;
+        return true;
+    }
+
+    bool IsTiled() const { return m_tiled.IsOpen(); }
+
+    static bool IsTiledFilename(const char* filename) {
+        const size_t len = strlen(filename);
+        return len > 8 && strcmp(filename + len - 8, ".d2tiles") == 0;
+    }
 
+    // The layers for tile (tx, ty) of a tiled map, which cover the tile and kRoadTilePadding round it.
+    // Safe from any thread; two threads asking for the same new tile may both build it, the first one in is kept.
+    std::shared_ptr<const DriveableArea> RoadTile(int tx, int ty) const {
+        const uint32_t id = uint32_t(ty) * m_tiled.Header().tilesX + uint32_t(tx);
+        {
+            std::lock_guard<std::mutex> lock(m_tileMutex);
+            for (auto it = m_roadTiles.begin(); it != m_roadTiles.end(); ++it) {
+                if (it->first == id) {
+                    m_roadTiles.splice(m_roadTiles.begin(), m_roadTiles, it);
+                    return it->second;
+                }
+            }
+        }
+        // the padding stops at the map edge, which then ends the tile the same way it ends the whole image
+        const int size = int(m_tiled.Header().tileSize);
+        const int x0 = std::max(tx * size - kRoadTilePadding, 0);
+        const int y0 = std::max(ty * size - kRoadTilePadding, 0);
+        const int x1 = int(std::min(int64_t(tx + 1) * size + kRoadTilePadding, int64_t(width)));
+        const int y1 = int(std::min(int64_t(ty + 1) * size + kRoadTilePadding, int64_t(height)));
+        std::vector<uint8_t> rgba(size_t(x1 - x0) * size_t(y1 - y0) * 4);
+        m_tiled.ReadRegion(x0, y0, x1 - x0, y1 - y0, rgba.data());
+        std::shared_ptr<const DriveableArea> tile = std::make_shared<DriveableArea>(rgba.data(), x1 - x0, y1 - y0, Vec2D(float(x0), float(y0)));
+
+        std::lock_guard<std::mutex> lock(m_tileMutex);
+        for (auto it = m_roadTiles.begin(); it != m_roadTiles.end(); ++it) {
+            if (it->first == id) {
+                return it->second;
+            }
+        }
+        m_roadTiles.emplace_front(id, tile);
+        if (m_roadTiles.size() > kRoadTileCapacity) {
+            m_roadTiles.pop_back();
+        }
+        return tile;
+    }
+
+    // Every road and tree edge segment within radius of p, fn(uint32_t, const Segment&) as for SegmentBvh::Query.
+    // A tiled map asks each tile it overlaps and keeps the segments centred in the tile proper, so each comes up once.
+    template<typename Fn>
+    void QueryEdges(const Vec2D& p, float radius, Fn fn) const {
+        if (!IsTiled()) {
+            m_edges.Query(p, radius, fn);
+            return;
+        }
+        const TiledMapFormat::Header& header = m_tiled.Header();
+        const float size = float(header.tileSize);
+        const int tx0 = std::max(int(floorf((p.x - radius) / size)), 0);
+        const int ty0 = std::max(int(floorf((p.y - radius) / size)), 0);
+        const int tx1 = std::min(int(floorf((p.x + radius) / size)), int(header.tilesX) - 1);
+        const int ty1 = std::min(int(floorf((p.y + radius) / size)), int(header.tilesY) - 1);
+        for (int ty = ty0; ty <= ty1; ++ty) {
+            for (int tx = tx0; tx <= tx1; ++tx) {
+                std::shared_ptr<const DriveableArea> tile = RoadTile(tx, ty);
+                tile->m_edges.Query(p, radius, [&](uint32_t id, const Segment& seg) {
+                    if (InTile(seg, tx, ty)) {
+                        fn(id, seg);
+                    }
+                });
+            }
+        }
+    }
+
+    // the offline half of LoadCompiled
+    bool SaveCompiled(const char* filename) const {
+        if (!m_loaded || IsTiled()) {
+            return false;
+        }
+        std::vector<uint8_t> boundaries;
+        WriteBoundaries(boundaries);
+        MapFileWriter writer;
+        writer.AddSection(MapFormat::kRgba, m_rgba.data(), m_rgba.size());
+        writer.AddSection(MapFormat::kOccupancy, m_driveable.data(), m_driveable.size());
+        writer.AddSection(MapFormat::kOccupancyMips, m_coverageMips.data(), m_coverageMips.size());
+        writer.AddSection(MapFormat::kSdf, m_sdf.data(), m_sdf.size() * sizeof(float));
+        writer.AddSection(MapFormat::kTrees, m_trees.data(), m_trees.size());
+        writer.AddSection(MapFormat::kBoundaries, boundaries.data(), boundaries.size());
+        writer.AddSection(MapFormat::kEdgeSegments, m_edges.Segments().data(), m_edges.Segments().size() * sizeof(Segment));
+        writer.AddSection(MapFormat::kEdgeNodes, m_edges.Nodes().data(), m_edges.Nodes().size() * sizeof(SegmentBvh::Node));
+        return writer.Write(filename, uint32_t(width), uint32_t(height));
+    }
+
+    GLuint glInitTexture() const
+    {
+        GLuint t = 0;
         glGenTextures(1, &t);
         glBindTexture(GL_TEXTURE_2D, t);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -29,13 +277,299 @@ public:
         //unsigned char data[] = { 80, 80, 80, 255 };
         //GLsizei w = 1;
         //GLsizei h = 1;
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-
-        stbi_image_free(data);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, m_rgba.data());
         return t;
     }
 
-    void Render() {
+    // tarmac is drawn in neutral grey, anything coloured (grass, trees) or near white (background) isn't road
+    static bool IsRoadPixel(const unsigned char* rgba) {
+        const int lo = std::min(std::min(rgba[0], rgba[1]), rgba[2]);
+        const int hi = std::max(std::max(rgba[0], rgba[1]), rgba[2]);
+        return rgba[3] > 128 && hi - lo <= 2 && lo >= 0x40 && hi <= 0xe0;
+    }
+
+    void BuildDriveable(const unsigned char* rgba) {
+        std::vector<uint8_t> driveable(size_t(width) * size_t(height));
+        for (size_t i = 0; i < driveable.size(); ++i) {
+            driveable[i] = IsRoadPixel(rgba + 4 * i) ? 1 : 0;
+        }
+        m_driveable.Assign(std::move(driveable));
+    }
+
+    // 0 for an empty map, which has no levels
+    static size_t CoverageMipsSize(int w, int h) {
+        if (w <= 0 || h <= 0) {
+            return 0;
+        }
+        size_t size = 0;
+        for (;;) {
+            size += size_t(w) * size_t(h);
+            if (w == 1 && h == 1) {
+                return size;
+            }
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+    }
+
+    // Level 0 is the occupancy scaled to 255, each level after averages 2x2 of the one before.
+    // Odd edges average what is there.
+    void BuildCoverageMips() {
+        std::vector<uint8_t> mips(CoverageMipsSize(width, height));
+        for (size_t i = 0; i < m_driveable.size(); ++i) {
+            mips[i] = m_driveable[i] ? 255 : 0;
+        }
+        size_t src = 0;
+        int w = width, h = height;
+        while (w > 1 || h > 1) {
+            const int nw = (w + 1) / 2;
+            const int nh = (h + 1) / 2;
+            const size_t dst = src + size_t(w) * size_t(h);
+            for (int y = 0; y < nh; ++y) {
+                for (int x = 0; x < nw; ++x) {
+                    int sum = 0, n = 0;
+                    for (int sy = 2 * y; sy < std::min(2 * y + 2, h); ++sy) {
+                        for (int sx = 2 * x; sx < std::min(2 * x + 2, w); ++sx) {
+                            sum += mips[src + size_t(sy) * w + sx];
+                            ++n;
+                        }
+                    }
+                    mips[dst + size_t(y) * nw + x] = uint8_t((sum + n / 2) / n);
+                }
+            }
+            src = dst;
+            w = nw;
+            h = nh;
+        }
+        m_coverageMips.Assign(std::move(mips));
+    }
+
+    // Coverage mip level (0 = full resolution), nullptr past the last level
+    const uint8_t* CoverageMip(int level, int& w, int& h) const {
+        size_t offset = 0;
+        w = width;
+        h = height;
+        for (int l = 0; l < level; ++l) {
+            if (w == 1 && h == 1) {
+                return nullptr;
+            }
+            offset += size_t(w) * size_t(h);
+            w = (w + 1) / 2;
+            h = (h + 1) / 2;
+        }
+        return m_coverageMips.data() + offset;
+    }
+
+    // kBoundaries section, see MapFormat
+    void WriteBoundaries(std::vector<uint8_t>& out) const {
+        std::vector<uint32_t> counts;
+        counts.push_back(uint32_t(m_boundaries.size()));
+        for (const auto& poly : m_boundaries) {
+            counts.push_back(uint32_t(poly.size()));
+        }
+        out.resize(counts.size() * sizeof(uint32_t));
+        memcpy(out.data(), counts.data(), out.size());
+        for (const auto& poly : m_boundaries) {
+            const size_t at = out.size();
+            out.resize(at + poly.size() * sizeof(Vec2D));
+            if (!poly.empty()) {
+                memcpy(&out[at], poly.data(), poly.size() * sizeof(Vec2D));
+            }
+        }
+    }
+
+    bool ReadBoundaries(const uint8_t* p, size_t size) {
+        uint32_t numLoops;
+        if (size < sizeof(numLoops)) {
+            return false;
+        }
+        memcpy(&numLoops, p, sizeof(numLoops));
+        size_t at = sizeof(numLoops);
+        if ((size - at) / sizeof(uint32_t) < numLoops) {
+            return false;
+        }
+        std::vector<uint32_t> counts(numLoops);
+        if (numLoops) {
+            memcpy(counts.data(), p + at, numLoops * sizeof(uint32_t));
+        }
+        at += numLoops * sizeof(uint32_t);
+        m_boundaries.assign(numLoops, Polyline());
+        for (uint32_t i = 0; i < numLoops; ++i) {
+            if ((size - at) / sizeof(Vec2D) < counts[i]) {
+                return false;
+            }
+            m_boundaries[i].resize(counts[i]);
+            if (counts[i]) {
+                memcpy(static_cast<void*>(m_boundaries[i].data()), p + at, counts[i] * sizeof(Vec2D));
+            }
+            at += counts[i] * sizeof(Vec2D);
+        }
+        return true;
+    }
+
+    // Trees are the sprites from scenarios/trees.png pasted along the verge: small islands of anything that
+    // isn't background. The road and grass form one huge island and are left out.
+    void BuildTrees(const unsigned char* rgba) {
+        const size_t count = size_t(width) * size_t(height);
+        std::vector<uint8_t> scenery(count);
+        for (size_t i = 0; i < count; ++i) {
+            const unsigned char* p = rgba + 4 * i;
+            scenery[i] = (p[3] > 128 && std::min(std::min(p[0], p[1]), p[2]) < 0xe0) ? 1 : 0;
+        }
+        std::vector<uint8_t> trees(count, 0);
+        std::vector<size_t> island;
+        std::vector<size_t> stack;
+        for (size_t start = 0; start < count; ++start) {
+            if (scenery[start] != 1) {
+                continue;
+            }
+            // flood fill, visited pixels are marked 2
+            island.clear();
+            stack.push_back(start);
+            scenery[start] = 2;
+            while (!stack.empty()) {
+                const size_t i = stack.back();
+                stack.pop_back();
+                island.push_back(i);
+                const int x = int(i % size_t(width));
+                const int y = int(i / size_t(width));
+                const size_t neighbours[4] = { x > 0 ? i - 1 : i, x + 1 < width ? i + 1 : i, y > 0 ? i - width : i, y + 1 < height ? i + width : i };
+                for (size_t n : neighbours) {
+                    if (scenery[n] == 1) {
+                        scenery[n] = 2;
+                        stack.push_back(n);
+                    }
+                }
+            }
+            if (island.size() <= kMaxTreeArea) {
+                for (size_t i : island) {
+                    trees[i] = 1;
+                }
+            }
+        }
+        m_trees.Assign(std::move(trees));
+    }
+
+    void BuildEdges() {
+        std::vector<Polyline> loops;
+        ExtractContours(m_driveable.data(), width, height, loops);
+        ExtractContours(m_trees.data(), width, height, loops);
+        std::vector<Segment> segments;
+        m_boundaries.clear();
+        for (auto& loop : loops) {
+            if (fabsf(LoopArea(loop)) < kMinIslandArea) {
+                continue;   // stray grey pixels in the tree line, twigs
+            }
+            for (auto& p : loop) {
+                p = Add(p, m_origin);
+            }
+            m_boundaries.push_back(SimplifyLoop(loop, kEdgeTolerance));
+            const Polyline& poly = m_boundaries.back();
+            for (size_t i = 0; i < poly.size(); ++i) {
+                const Vec2D& a = poly[i];
+                const Vec2D& b = poly[(i + 1) % poly.size()];
+                const int pieces = std::max(1, int(ceilf(Length(Sub(b, a)) / kMaxEdgeLength)));
+                for (int k = 0; k < pieces; ++k) {
+                    Segment seg;
+                    seg.a = Add(a, Mult(Sub(b, a), float(k) / float(pieces)));
+                    seg.b = Add(a, Mult(Sub(b, a), float(k + 1) / float(pieces)));
+                    segments.push_back(seg);
+                }
+            }
+        }
+        m_edges.Build(segments);
+    }
+
+    void RenderEdges() const {
+        glLoadIdentity();
+        glColor3f(1.0f, 1.0f, 0.0f);
+        if (IsTiled()) {
+            // whatever tiles the simulation has built so far
+            const uint32_t tilesX = m_tiled.Header().tilesX;
+            std::lock_guard<std::mutex> lock(m_tileMutex);
+            glBegin(GL_LINES);
+            for (const auto& tile : m_roadTiles) {
+                for (const auto& seg : tile.second->m_edges.Segments()) {
+                    if (InTile(seg, int(tile.first % tilesX), int(tile.first / tilesX))) {
+                        glVertex3f(seg.a.x, seg.a.y, 0.0f);
+                        glVertex3f(seg.b.x, seg.b.y, 0.0f);
+                    }
+                }
+            }
+            glEnd();
+            return;
+        }
+        for (const auto& poly : m_boundaries) {
+            glBegin(GL_LINE_LOOP);
+            for (const auto& p : poly) {
+                glVertex3f(p.x, p.y, 0.0f);
+            }
+            glEnd();
+        }
+    }
+
+    // O(1) signed distance to the road edge in metres, bilinear between pixel centres.
+    // Outside the map counts as off road.
+    float SignedDistance(const Vec2D& p) const {
+        if (IsTiled()) {
+            return TiledSignedDistance(p);
+        }
+        if (m_sdf.empty()) {
+            return FLT_MAX;
+        }
+        const Vec2D q = Sub(p, m_origin);
+        const float fx = std::min(std::max(q.x - 0.5f, 0.0f), float(width - 1));
+        const float fy = std::min(std::max(q.y - 0.5f, 0.0f), float(height - 1));
+        const int x0 = std::min(int(fx), width - 2 < 0 ? 0 : width - 2);
+        const int y0 = std::min(int(fy), height - 2 < 0 ? 0 : height - 2);
+        const int x1 = std::min(x0 + 1, width - 1);
+        const int y1 = std::min(y0 + 1, height - 1);
+        const float tx = fx - float(x0);
+        const float ty = fy - float(y0);
+        const float d00 = m_sdf[size_t(y0) * width + x0];
+        const float d10 = m_sdf[size_t(y0) * width + x1];
+        const float d01 = m_sdf[size_t(y1) * width + x0];
+        const float d11 = m_sdf[size_t(y1) * width + x1];
+        const float d = (d00 * (1.0f - tx) + d10 * tx) * (1.0f - ty) + (d01 * (1.0f - tx) + d11 * tx) * ty;
+
+        // distance outside the image on top of whatever the border pixel says
+        const float ox = std::max(std::max(-q.x, q.x - float(width)), 0.0f);
+        const float oy = std::max(std::max(-q.y, q.y - float(height)), 0.0f);
+        if (ox > 0.0f || oy > 0.0f) {
+            return std::max(d, 0.0f) + sqrtf(ox * ox + oy * oy);
+        }
+        return d;
+    }
+
+    // As above from the tile under p, or the nearest tile off the map. Those tiles end where the map does.
+    float TiledSignedDistance(const Vec2D& p) const {
+        const int size = int(m_tiled.Header().tileSize);
+        const int tx = std::min(std::max(int(floorf(p.x / float(size))), 0), int(m_tiled.Header().tilesX) - 1);
+        const int ty = std::min(std::max(int(floorf(p.y / float(size))), 0), int(m_tiled.Header().tilesY) - 1);
+        return RoadTile(tx, ty)->SignedDistance(p);
+    }
+
+    // true if the segment's midpoint is in tile (tx, ty) proper, not its padding
+    bool InTile(const Segment& seg, int tx, int ty) const {
+        const float size = float(m_tiled.Header().tileSize);
+        const float mx = 0.5f * (seg.a.x + seg.b.x) - float(tx) * size;
+        const float my = 0.5f * (seg.a.y + seg.b.y) - float(ty) * size;
+        return mx >= 0.0f && mx < size && my >= 0.0f && my < size;
+    }
+
+    // true if any part of a disc of radius at p is off the road
+    bool IsOffRoad(const Vec2D& p, float radius) const {
+        return SignedDistance(p) > -radius;
+    }
+
+    // nothing for a tiled map, the simulator streams those in with a TiledMap
+    void Render() const {
+        if (m_rgba.empty()) {
+            return;
+        }
+        if (m_tex == 0) {
+            m_tex = glInitTexture();
+        }
         glEnable(GL_TEXTURE_2D);
 
         glLoadIdentity();                   // Reset The Current Modelview Matrix
@@ -55,26 +589,330 @@ public:
 
         glDisable(GL_TEXTURE_2D);
     }
+
+private:
+    MapFile m_file;     // compiled maps only, the layers point into it
+    bool    m_loaded = false;
+
+    // tiled maps only, built tiles by id most recently used first
+    TiledMapFile m_tiled;
+    mutable std::mutex m_tileMutex;
+    mutable std::list<std::pair<uint32_t, std::shared_ptr<const DriveableArea>>> m_roadTiles;
+};
+
+// Where a point is along a lane: arc length from the lane's start and signed distance off its centerline.
+struct LanePosition
+{
+    uint8_t lane = 0;       // 0 = not on a lane
+    float   s = 0.0f;       // m along the centerline
+    float   offset = 0.0f;  // m, positive on the side Cross(direction of travel, offset) > 0
+};
+
+// One lane's centerline, points run in the direction of travel.
+struct LaneCenterline
+{
+    Polyline            points;
+    std::vector<float>  arcLength;  // m from points[0] to each point
+    std::vector<float>  axisT;      // projection of each point on axis, strictly increasing
+    Vec2D               origin = Vec2D(0.0f, 0.0f);     // mean of the lane's pixels
+    Vec2D               axis = Vec2D(1.0f, 0.0f);       // principal axis, pointing the way traffic goes
+
+    float Length() const { return arcLength.empty() ? 0.0f : arcLength.back(); }
 };
 
-class Lane {
+// Lanes from the scenario's lane map, an image the size of the driveable map where
+// red = lane id (1..255, 0 or transparent for no lane) and green = direction of travel in 256ths of a turn
+// (0 = +x, 64 = +y). Each pixel gets a byte of lane id, and every lane a centerline from binning its pixels
+// along their principal axis, so a lane has to run roughly straight; split curves into several lanes.
+// Locate() is a raster read and a binary search over one centerline.
+// The lane graph comes from the same data: lanes whose ends meet are successors, lanes sharing a long side in the
+// same direction are adjacent, and lanes whose centerlines cross, that touch at an angle or that merge conflict.
+class LaneMap {
 public:
+    int width = 0, height = 0;
 
-    void Render() {
-        glLoadIdentity();                   // Reset The Current Modelview Matrix
-        glTranslatef(0.0f, 0.0f, 0.0f);              // Move Right 1.5 Units And Into The Screen 6.0
-        //glRotatef(m_rot, 0.0f, 0.0f, 1.0f);            // Rotate The Quad On The X axis ( NEW )
-        glScalef(0.25f, 1.0f, 1.0f);
+    std::vector<uint8_t>        m_ids;          // lane id per pixel
+    std::vector<LaneCenterline> m_centerlines;  // by id, empty for ids not in the map
+    LaneGraph                   m_graph;        // a node per id
 
-        glColor3f(0.5f, 0.5f, 0.0f);            // Set The Color To A Nice Yellow Shade
-        glBegin(GL_QUADS);                      // Start Drawing A Quad
-        glVertex3f(-1.0f, 1.0f, 0.0f);         // Top Left Of The Quad
-        glVertex3f(1.0f, 1.0f, 0.0f);           // Top Right Of The Quad
-        glVertex3f(1.0f, -1.0f, 0.0f);          // Bottom Right Of The Quad
-        glVertex3f(-1.0f, -1.0f, 0.0f);          // Bottom Left Of The Quad
-        glEnd();                                // Done Drawing The Quad
+    static constexpr float kBinLength = 1.0f;       // m along the axis per centerline sample
+    static constexpr float kTolerance = 0.1f;       // m, centerline simplification
+    static constexpr float kConnectDistance = 3.0f; // m between one lane's end and the next one's start
+    static constexpr float kMinSharedSide = 4.0f;   // m of common boundary for a lane change
+    static constexpr float kMinParallel = 0.866f;   // cos 30 degrees
+
+    // the signature AssetLoader wants
+    LaneMap(ThreadPool& pool, const char* filename) {
+        m_loaded = LoadImage(filename, pool);
+    }
+
+    LaneMap(const LaneMap&) = delete;
+    LaneMap& operator=(const LaneMap&) = delete;
+
+    bool IsLoaded() const { return m_loaded; }
+
+    bool LoadImage(const char* filename, ThreadPool& pool) {
+        int channels = 0;
+        unsigned char* data = stbi_load(filename, &width, &height, &channels, 4);
+        if (!data) {
+            return false;
+        }
+        // one pass for ids and per lane pixel lists and headings
+        const size_t count = size_t(width) * size_t(height);
+        m_ids.assign(count, 0);
+        std::vector<std::vector<uint32_t>> pixels(256);
+        std::vector<Vec2D> headings(256, Vec2D(0.0f, 0.0f));
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* rgba = data + i * 4;
+            if (rgba[0] == 0 || rgba[3] == 0) {
+                continue;
+            }
+            m_ids[i] = rgba[0];
+            pixels[rgba[0]].push_back(uint32_t(i));
+            const float angle = float(rgba[1]) * (2.0f * float(M_PI) / 256.0f);
+            headings[rgba[0]] = Add(headings[rgba[0]], Vec2D(cosf(angle), sinf(angle)));
+        }
+        stbi_image_free(data);
+
+        size_t numIds = 0;
+        for (size_t id = 1; id < pixels.size(); ++id) {
+            if (!pixels[id].empty()) {
+                numIds = id + 1;
+            }
+        }
+        m_centerlines.clear();
+        m_centerlines.resize(numIds);
+        pool.ParallelFor(numIds, 1, [&](size_t begin, size_t end, unsigned) {
+            for (size_t id = begin; id < end; ++id) {
+                if (!pixels[id].empty()) {
+                    BuildCenterline(pixels[id], headings[id], m_centerlines[id]);
+                }
+            }
+        });
+        BuildGraph();
+        return true;
+    }
+
+    uint8_t LaneAt(const Vec2D& p) const {
+        const int x = int(floorf(p.x));
+        const int y = int(floorf(p.y));
+        if (x < 0 || y < 0 || x >= width || y >= height) {
+            return 0;
+        }
+        return m_ids[size_t(y) * width + x];
+    }
+
+    // false (and out.lane = 0) off every lane
+    bool Locate(const Vec2D& p, LanePosition& out) const {
+        return Project(LaneAt(p), p, out);
+    }
+
+    // p in the frame of the given lane wherever p is, false if there is no such lane
+    bool Project(uint8_t id, const Vec2D& p, LanePosition& out) const {
+        out = LanePosition();
+        if (id == 0 || id >= m_centerlines.size() || m_centerlines[id].points.empty()) {
+            return false;
+        }
+        const LaneCenterline& c = m_centerlines[id];
+        out.lane = id;
+        if (c.points.size() == 1) {
+            out.offset = Cross(c.axis, Sub(p, c.points[0]));
+            return true;
+        }
+        // the segment whose axis span holds p, clamped to the ends
+        const float t = Dot(Sub(p, c.origin), c.axis);
+        size_t i = size_t(std::upper_bound(c.axisT.begin(), c.axisT.end(), t) - c.axisT.begin());
+        i = std::min(std::max(i, size_t(1)), c.points.size() - 1) - 1;
+        const Vec2D a = c.points[i];
+        const Vec2D ab = Sub(c.points[i + 1], a);
+        const float len = c.arcLength[i + 1] - c.arcLength[i];
+        const Vec2D dir = Mult(ab, 1.0f / len);
+        const float along = std::min(std::max(Dot(Sub(p, a), dir), 0.0f), len);
+        out.s = c.arcLength[i] + along;
+        out.offset = Cross(dir, Sub(p, a));
+        return true;
+    }
+
+    void Render() const {
+        glLoadIdentity();
+        glColor3f(0.5f, 0.5f, 0.0f);
+        for (const auto& c : m_centerlines) {
+            glBegin(GL_LINE_STRIP);
+            for (const auto& p : c.points) {
+                glVertex3f(p.x, p.y, 0.0f);
+            }
+            glEnd();
+        }
+    }
+
+private:
+    // PCA of the pixel centres for the axis, then the centroid of every kBinLength slice along it
+    void BuildCenterline(const std::vector<uint32_t>& pixels, const Vec2D& heading, LaneCenterline& out) const {
+        auto centre = [&](uint32_t i) {
+            return Vec2D(float(i % uint32_t(width)) + 0.5f, float(i / uint32_t(width)) + 0.5f);
+        };
+        double sx = 0.0, sy = 0.0;
+        for (uint32_t i : pixels) {
+            const Vec2D p = centre(i);
+            sx += p.x;
+            sy += p.y;
+        }
+        const double n = double(pixels.size());
+        const Vec2D origin(float(sx / n), float(sy / n));
+        double cxx = 0.0, cxy = 0.0, cyy = 0.0;
+        for (uint32_t i : pixels) {
+            const Vec2D d = Sub(centre(i), origin);
+            cxx += double(d.x) * d.x;
+            cxy += double(d.x) * d.y;
+            cyy += double(d.y) * d.y;
+        }
+        // major eigenvector of the 2x2 covariance
+        const float angle = 0.5f * float(atan2(2.0 * cxy, cxx - cyy));
+        Vec2D axis(cosf(angle), sinf(angle));
+        if (Dot(axis, heading) < 0.0f) {
+            axis = Mult(axis, -1.0f);
+        }
+
+        float tMin = FLT_MAX, tMax = -FLT_MAX;
+        for (uint32_t i : pixels) {
+            const float t = Dot(Sub(centre(i), origin), axis);
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+        const size_t numBins = size_t((tMax - tMin) / kBinLength) + 1;
+        std::vector<Vec2D> sums(numBins, Vec2D(0.0f, 0.0f));
+        std::vector<uint32_t> counts(numBins, 0);
+        for (uint32_t i : pixels) {
+            const Vec2D d = Sub(centre(i), origin);
+            const size_t bin = std::min(size_t((Dot(d, axis) - tMin) / kBinLength), numBins - 1);
+            sums[bin] = Add(sums[bin], d);
+            ++counts[bin];
+        }
+        Polyline samples;
+        for (size_t b = 0; b < numBins; ++b) {
+            if (counts[b]) {
+                samples.push_back(Add(origin, Mult(sums[b], 1.0f / float(counts[b]))));
+            }
+        }
+        if (samples.size() > 2) {
+            Polyline simplified;
+            SimplifyRange(samples, 0, samples.size() - 1, kTolerance, simplified);
+            simplified.push_back(samples.back());
+            samples.swap(simplified);
+        }
+
+        out.origin = origin;
+        out.axis = axis;
+        out.points.clear();
+        out.axisT.clear();
+        for (const auto& p : samples) {
+            // keep t strictly increasing so every segment the search lands on has a length
+            const float t = Dot(Sub(p, origin), axis);
+            if (out.axisT.empty() || t > out.axisT.back()) {
+                out.points.push_back(p);
+                out.axisT.push_back(t);
+            }
+        }
+        out.arcLength.assign(out.points.size(), 0.0f);
+        for (size_t i = 1; i < out.points.size(); ++i) {
+            out.arcLength[i] = out.arcLength[i - 1] + Length(Sub(out.points[i], out.points[i - 1]));
+        }
+    }
+
+    // end and start directions of a centerline
+    static Vec2D EndDirection(const LaneCenterline& c, bool start) {
+        if (c.points.size() < 2) {
+            return c.axis;
+        }
+        const size_t n = c.points.size();
+        return Normalize(start ? Sub(c.points[1], c.points[0]) : Sub(c.points[n - 1], c.points[n - 2]));
+    }
+
+    static bool CenterlinesCross(const LaneCenterline& a, const LaneCenterline& b) {
+        for (size_t i = 1; i < a.points.size(); ++i) {
+            for (size_t j = 1; j < b.points.size(); ++j) {
+                if (SegmentsCross(a.points[i - 1], a.points[i], b.points[j - 1], b.points[j])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void BuildGraph() {
+        const size_t numLanes = m_centerlines.size();
+        // pixels of one lane 4-connected to another, a count per unordered pair
+        std::vector<uint32_t> touching(numLanes * numLanes, 0);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const uint8_t a = m_ids[size_t(y) * width + x];
+                const uint8_t right = x + 1 < width ? m_ids[size_t(y) * width + x + 1] : 0;
+                const uint8_t down = y + 1 < height ? m_ids[size_t(y + 1) * width + x] : 0;
+                if (a && right && right != a) {
+                    ++touching[size_t(std::min(a, right)) * numLanes + std::max(a, right)];
+                }
+                if (a && down && down != a) {
+                    ++touching[size_t(std::min(a, down)) * numLanes + std::max(a, down)];
+                }
+            }
+        }
 
+        std::vector<LaneEdge> edges;
+        auto add = [&](size_t from, size_t to, LaneEdge::Kind kind, float cost) {
+            LaneEdge e;
+            e.from = uint8_t(from);
+            e.to = uint8_t(to);
+            e.kind = kind;
+            e.cost = cost;
+            edges.push_back(e);
+        };
+        auto exists = [&](size_t id) { return !m_centerlines[id].points.empty(); };
+        std::vector<uint8_t> successor(numLanes * numLanes, 0);
+        for (size_t a = 1; a < numLanes; ++a) {
+            for (size_t b = 1; b < numLanes; ++b) {
+                if (a == b || !exists(a) || !exists(b)) {
+                    continue;
+                }
+                const LaneCenterline& ca = m_centerlines[a];
+                const LaneCenterline& cb = m_centerlines[b];
+                if (Length(Sub(cb.points.front(), ca.points.back())) <= kConnectDistance &&
+                    Dot(EndDirection(ca, false), EndDirection(cb, true)) > 0.5f) {
+                    successor[a * numLanes + b] = 1;
+                    add(a, b, LaneEdge::kSuccessor, std::max(ca.Length(), kBinLength));
+                }
+            }
+        }
+        for (size_t a = 1; a < numLanes; ++a) {
+            for (size_t b = a + 1; b < numLanes; ++b) {
+                if (!exists(a) || !exists(b) || successor[a * numLanes + b] || successor[b * numLanes + a]) {
+                    continue;
+                }
+                const LaneCenterline& ca = m_centerlines[a];
+                const LaneCenterline& cb = m_centerlines[b];
+                const float parallel = Dot(ca.axis, cb.axis);
+                const uint32_t shared = touching[a * numLanes + b];
+                bool conflict = CenterlinesCross(ca, cb);
+                if (!conflict && parallel > kMinParallel && float(shared) >= kMinSharedSide) {
+                    add(a, b, LaneEdge::kAdjacent, LaneGraph::kLaneChangeCost);
+                    add(b, a, LaneEdge::kAdjacent, LaneGraph::kLaneChangeCost);
+                    continue;
+                }
+                // touching at an angle, e.g. a junction
+                conflict |= shared > 0 && fabsf(parallel) <= kMinParallel;
+                // merging into the same lane
+                for (size_t c = 1; c < numLanes && !conflict; ++c) {
+                    conflict = successor[a * numLanes + c] && successor[b * numLanes + c];
+                }
+                if (conflict) {
+                    add(a, b, LaneEdge::kConflict, 0.0f);
+                    add(b, a, LaneEdge::kConflict, 0.0f);
+                }
+            }
+        }
+        m_graph.Build(numLanes, std::move(edges));
     }
+
+    bool m_loaded = false;
 };
 
 class Vehicle {
@@ -82,10 +920,21 @@ public:
     float m_rot;
     Vec2D m_pos;
     Vec2D m_v = Vec2D(0.0f, 0.0f);
-    float m_radius = 1.0f; //m - width of all cars ~2m, need to handle length up to truck length somehow...
+    float m_radius = 1.0f; //m - round the core below, half the width of circles and capsules, ~1 for cars
+    float m_halfLength = 0.0f;      // m, core from the centre along the heading, 0 for a circle
+    float m_halfWidth = 0.0f;       // m, core from the centre across the heading, 0 unless a box
     bool m_orbit = false;
     float m_time = 0.0f;
     Vec2D m_center = Vec2D(0.0f, 0.0f);
+    Vec2D m_voVelocity = Vec2D(0.0f, 0.0f); // nearest velocity to m_v that the VO map leaves free
+    float m_roadDistance = 0.0f;    // signed distance to the road edge, negative on the road
+    bool m_offRoad = false;
+    LanePosition m_lanePos;         // lane 0 without a lane map
+    uint8_t m_destination = 0;      // lane to route to, 0 for none
+    uint8_t m_nextLane = 0;         // next lane on the route, 0 without one
+    uint32_t m_id = 0;              // stable handle, the order vehicles were added in; storage order may change
+    float m_maxAccel = 6.0f;        // m/s^2 the velocity can change by, see ReachableVelocities()
+    float m_maxTurnRate = 90.0f;    // degrees/s the direction of travel can turn
 
     Vehicle(float x, float y, float rot)
     : m_pos(x, y)
@@ -101,14 +950,59 @@ public:
     {
 
     }
+    // where an orbiting vehicle is at time
+    Vec2D OrbitPosition(float time) const {
+        float radius = 6.0f; // metres
+        static float baseSpeed = 4.0f; // 30 mph in m/s
+        float circumference = 2.0f * float(M_PI) * radius;
+        float speed = (2.0f * float(M_PI) * baseSpeed) / circumference;
+        return Add(m_center, Mult(Vec2D(sinf(speed*time), cosf(speed*time)), radius));
+    }
+
+    // Bounding box of the velocities the vehicle can reach within time: within m_maxAccel * time of m_v and, while it
+    // can't just stop and pull away in another direction, within m_maxTurnRate * time of its heading too.
+    void ReachableVelocities(float time, Vec2D& lo, Vec2D& hi) const {
+        const float reach = m_maxAccel * time;
+        lo = Sub(m_v, Vec2D(reach, reach));
+        hi = Add(m_v, Vec2D(reach, reach));
+        const float speed = Length(m_v);
+        const float turn = DegToRad(m_maxTurnRate * time);
+        if (speed <= reach || turn >= float(M_PI)) {
+            return;
+        }
+        // the part of the ring of reachable speeds within turn of the heading, its box is made by its corners and
+        // wherever the outer arc crosses an axis
+        const float heading = atan2f(m_v.y, m_v.x);
+        Vec2D sectorLo(FLT_MAX, FLT_MAX);
+        Vec2D sectorHi(-FLT_MAX, -FLT_MAX);
+        auto add = [&](float angle, float r) {
+            const Vec2D p(r * cosf(angle), r * sinf(angle));
+            sectorLo = Vec2D(std::min(sectorLo.x, p.x), std::min(sectorLo.y, p.y));
+            sectorHi = Vec2D(std::max(sectorHi.x, p.x), std::max(sectorHi.y, p.y));
+        };
+        for (int side = -1; side <= 1; side += 2) {
+            add(heading + float(side) * turn, speed - reach);
+            add(heading + float(side) * turn, speed + reach);
+        }
+        for (int k = -4; k <= 4; ++k) {
+            const float axis = float(k) * 0.5f * float(M_PI);
+            if (fabsf(axis - heading) <= turn) {
+                add(axis, speed + reach);
+            }
+        }
+        lo = Vec2D(std::max(lo.x, sectorLo.x), std::max(lo.y, sectorLo.y));
+        hi = Vec2D(std::min(hi.x, sectorHi.x), std::min(hi.y, sectorHi.y));
+    }
+
+    // where the vehicle will be dt from now, along its orbit or else at its current velocity
+    Vec2D PredictPosition(float dt) const {
+        return m_orbit ? OrbitPosition(m_time + dt) : Add(m_pos, Mult(m_v, dt));
+    }
+
     void Update(float dt) {
         m_time += dt;
         if (m_orbit) {
-            float radius = 6.0f; // metres
-            static float baseSpeed = 4.0f; // 30 mph in m/s
-            float circumference = 2.0f * float(M_PI) * radius;
-            float speed = (2.0f * float(M_PI) * baseSpeed) / circumference;
-            Vec2D newPos = Add(m_center, Mult(Vec2D(sinf(speed*m_time), cosf(speed*m_time)), radius));
+            Vec2D newPos = OrbitPosition(m_time);
             Vec2D movement = Sub(newPos, m_pos);
             m_pos = newPos;
             m_v = Mult(movement, 1.0f / dt);
@@ -116,17 +1010,85 @@ public:
             //int i = 0; ++i;
         }
         else {
-            m_v = Vec2D(0.0f, 0.0f);
+            // straight on at whatever velocity it was given, e.g. a scenario's "velocity", parked if none
+            m_pos = Add(m_pos, Mult(m_v, dt));
             //m_rot += 0.1f;
         }
 
     }
 
-	void Render() {
+    enum Shape {
+        kCircle,    // m_radius
+        kCapsule,   // length overall, m_radius either side of the centre line
+        kBox,       // length and width overall, corners rounded by kBoxCornerRadius
+    };
+
+    static constexpr float kBoxCornerRadius = 0.1f;
+
+    // sets the core, and for boxes m_radius, from the overall size
+    void SetShape(Shape shape, float length, float width) {
+        m_halfLength = 0.0f;
+        m_halfWidth = 0.0f;
+        if (shape == kCapsule) {
+            m_halfLength = std::max(0.5f * length - m_radius, 0.0f);
+        } else if (shape == kBox) {
+            m_radius = kBoxCornerRadius;
+            m_halfLength = std::max(0.5f * length - kBoxCornerRadius, 0.0f);
+            m_halfWidth = std::max(0.5f * width - kBoxCornerRadius, 0.0f);
+        }
+    }
+
+    bool HasCore() const {
+        return m_halfLength != 0.0f || m_halfWidth != 0.0f;
+    }
+
+    // furthest the core reaches from the centre
+    float CoreReach() const {
+        return HasCore() ? sqrtf(m_halfLength * m_halfLength + m_halfWidth * m_halfWidth) : 0.0f;
+    }
+
+    float BoundingRadius() const {
+        return m_radius + CoreReach();
+    }
+
+    // the shape as VelocityObstacle sees it
+    VelocityObstacle::Obstacle ToObstacle(float bias) const {
+        VelocityObstacle::Obstacle o;
+        o.position = m_pos;
+        o.velocity = m_v;
+        o.radius = m_radius;
+        o.bias = bias;
+        if (HasCore()) {
+            const float rot = DegToRad(m_rot);
+            const Vec2D heading(cosf(rot), sinf(rot));
+            o.halfLength = Mult(heading, m_halfLength);
+            o.halfWidth = Mult(Vec2D(-heading.y, heading.x), m_halfWidth);
+        }
+        return o;
+    }
+
+    // stationary this tick, other vehicles' static VO layers include it
+    bool IsParked() const {
+        return m_v.x == 0.0f && m_v.y == 0.0f;
+    }
+
+    uint64_t HashState(uint64_t h) const {
+        h = HashFloat(h, m_pos.x);
+        h = HashFloat(h, m_pos.y);
+        h = HashFloat(h, m_v.x);
+        h = HashFloat(h, m_v.y);
+        h = HashFloat(h, m_rot);
+        h = HashFloat(h, m_time);
+        h = HashFloat(h, m_voVelocity.x);
+        h = HashFloat(h, m_voVelocity.y);
+        return h;
+    }
+
+	void Render() const {
         glLoadIdentity();                   // Reset The Current Modelview Matrix
         glTranslatef(m_pos.x, m_pos.y, 0.0f);              // Move Right 1.5 Units And Into The Screen 6.0
         glRotatef(m_rot, 0.0f, 0.0f, 1.0f);            // Rotate The Quad On The X axis ( NEW )
-        glScalef(m_radius, m_radius, 1.0f);
+        glScalef(m_halfLength + m_radius, m_halfWidth + m_radius, 1.0f);
 
         glColor3f(0.5f, 0.0f, 0.0f);            // Set The Color To A Nice Red Shade
         glBegin(GL_QUADS);                      // Start Drawing A Quad
@@ -140,66 +1102,794 @@ public:
 
 };
 
-class Simulator {
+// Vehicles on each lane sorted by arc length, kept in order with an insertion sort since the order hardly changes
+// from one tick to the next. Gives every vehicle its leader and follower in its own lane, and the vehicles either
+// side of it in up to kMaxAdjacent lanes it could change into, each a table read. Adjacent lanes are swept with
+// two cursors, so the whole update is linear in the vehicle count apart from lane changes, which are rare.
+class LaneNeighbors {
 public:
-    Simulator()
-    {
-        m_vehicles.push_back(Vehicle(50.0f, 100.0f, 0.0f));
-        m_vehicles.push_back(Vehicle());
-        m_velocityObstacles.resize(2);
-    }
+    static const uint32_t kNone = UINT32_MAX;
+    static const int kMaxAdjacent = 2;
 
-    void Update() {
-        const float dt = 1.0f / 60.0f;
+    struct Gap {
+        uint8_t     lane = 0;           // 0 for an unused slot
+        uint32_t    leader = kNone;     // first vehicle level with or ahead of us in that lane
+        uint32_t    follower = kNone;   // first one behind
+    };
 
-        const size_t numVehicles = m_vehicles.size();
-        for (size_t i = 0; i<numVehicles; ++i) {
-            const auto& a = m_vehicles[i];
-            m_velocityObstacles[i].Clear();
-            VelocityObstacle::Obstacle va;
-            va.position = a.m_pos;
-            va.velocity = a.m_v;
-            va.radius = a.m_radius;
-            for (size_t j = 0; j < numVehicles; ++j) {
-                if (i == j) {
-                    continue;
-                }
-                const auto& b = m_vehicles[j];
+    struct Entry {
+        uint32_t    leader = kNone;     // next vehicle ahead in the same lane
+        uint32_t    follower = kNone;
+        Gap         adjacent[kMaxAdjacent];
+    };
 
-                VelocityObstacle::Obstacle vb;
-                vb.position = b.m_pos;
-                vb.velocity = b.m_v;
-                vb.radius = b.m_radius;
+    std::vector<Entry>      m_entries;  // per vehicle
 
-                va.bias = 0.0f; // 0.5f;
-                vb.bias = 1.0f; // 0.5f;
+    // vehicles' m_lanePos must be current
+    void Update(const LaneMap& lanes, const std::vector<Vehicle>& vehicles) {
+        const size_t numVehicles = vehicles.size();
+        const size_t numLanes = lanes.m_centerlines.size();
+        if (m_lanes != &lanes || m_laneOf.size() != numVehicles) {
+            m_lanes = &lanes;
+            m_sorted.assign(numLanes, std::vector<Slot>());
+            m_laneOf.assign(numVehicles, 0);
+        }
 
-                float dist = Length(Sub(vb.position, va.position));
-                float r_total = va.radius + vb.radius;
-                if (dist > r_total) {
-                    VelocityObstacle ob(va, vb);
-                    m_velocityObstacles[i].drawTriangle(ob);
-                } else {
-                    //TODO: actively colliding...
+        // lane changes, including joining or leaving the lanes
+        for (size_t i = 0; i < numVehicles; ++i) {
+            uint8_t lane = vehicles[i].m_lanePos.lane;
+            lane = lane < numLanes ? lane : 0;
+            if (lane != m_laneOf[i]) {
+                if (m_laneOf[i]) {
+                    std::vector<Slot>& from = m_sorted[m_laneOf[i]];
+                    from.erase(std::find_if(from.begin(), from.end(), [&](const Slot& slot) { return slot.vehicle == i; }));
                 }
+                if (lane) {
+                    Slot slot;
+                    slot.vehicle = uint32_t(i);
+                    m_sorted[lane].push_back(slot);
+                }
+                m_laneOf[i] = lane;
             }
-
-            m_velocityObstacles[i].UpdateDebugTexture();
         }
 
-        Vec2D center = m_vehicles[0].m_pos;
-        for (auto& v : m_vehicles) {
-            v.m_center = center;
-            v.Update(dt);
+        // new arc lengths, then insertion sort, which is linear when nothing overtook
+        for (auto& lane : m_sorted) {
+            for (auto& slot : lane) {
+                slot.s = vehicles[slot.vehicle].m_lanePos.s;
+            }
+            for (size_t k = 1; k < lane.size(); ++k) {
+                const Slot slot = lane[k];
+                size_t j = k;
+                for (; j > 0 && Before(slot, lane[j - 1]); --j) {
+                    lane[j] = lane[j - 1];
+                }
+                lane[j] = slot;
+            }
         }
 
-        static bool showDebugImage = true;
-        if (showDebugImage)
+        m_entries.assign(numVehicles, Entry());
+        for (size_t id = 1; id < numLanes; ++id) {
+            const std::vector<Slot>& lane = m_sorted[id];
+            for (size_t k = 0; k < lane.size(); ++k) {
+                Entry& e = m_entries[lane[k].vehicle];
+                e.leader = k + 1 < lane.size() ? lane[k + 1].vehicle : kNone;
+                e.follower = k > 0 ? lane[k - 1].vehicle : kNone;
+            }
+            if (lane.empty()) {
+                continue;
+            }
+            int slotIndex = 0;
+            lanes.m_graph.ForEachOut(uint8_t(id), [&](const LaneEdge& edge) {
+                if (edge.kind == LaneEdge::kAdjacent && slotIndex < kMaxAdjacent) {
+                    SweepAdjacent(lanes, vehicles, lane, edge.to, slotIndex++);
+                }
+            });
+        }
+    }
+
+    // vehicle i moved to newIndex[i], keeps the lane order so the next Update is still an almost sorted pass
+    void Remap(const std::vector<uint32_t>& newIndex) {
+        if (m_laneOf.size() != newIndex.size()) {
+            return;
+        }
+        std::vector<uint8_t> laneOf(m_laneOf.size());
+        for (size_t i = 0; i < m_laneOf.size(); ++i) {
+            laneOf[newIndex[i]] = m_laneOf[i];
+        }
+        m_laneOf.swap(laneOf);
+        for (auto& lane : m_sorted) {
+            for (auto& slot : lane) {
+                slot.vehicle = newIndex[slot.vehicle];
+            }
+        }
+        m_entries.clear();
+    }
+
+private:
+    struct Slot {
+        float       s = 0.0f;
+        uint32_t    vehicle = 0;
+    };
+
+    // ties by index so the order never depends on the order vehicles joined the lane
+    static bool Before(const Slot& a, const Slot& b) {
+        return a.s < b.s || (a.s == b.s && a.vehicle < b.vehicle);
+    }
+
+    // each vehicle in lane measured along other, the cursor only moves a step or two between vehicles
+    void SweepAdjacent(const LaneMap& lanes, const std::vector<Vehicle>& vehicles, const std::vector<Slot>& lane,
+        uint8_t other, int slotIndex) {
+        const std::vector<Slot>& target = m_sorted[other];
+        size_t cursor = 0;
+        for (const Slot& slot : lane) {
+            LanePosition p;
+            lanes.Project(other, vehicles[slot.vehicle].m_pos, p);
+            while (cursor < target.size() && target[cursor].s < p.s) {
+                ++cursor;
+            }
+            while (cursor > 0 && target[cursor - 1].s >= p.s) {
+                --cursor;
+            }
+            Gap& gap = m_entries[slot.vehicle].adjacent[slotIndex];
+            gap.lane = other;
+            gap.leader = cursor < target.size() ? target[cursor].vehicle : kNone;
+            gap.follower = cursor > 0 ? target[cursor - 1].vehicle : kNone;
+        }
+    }
+
+    const LaneMap*                  m_lanes = nullptr;
+    std::vector<std::vector<Slot>>  m_sorted;   // per lane id, by s
+    std::vector<uint8_t>            m_laneOf;   // per vehicle, the lane it is sorted into
+};
+
+// Verlet neighbour lists: every vehicle within the interaction radius plus a skin, rebuilt only once some vehicle
+// has moved half the skin since the last build (or sped up past the speed the radius was sized for), so pairs that
+// matter are always listed. The interaction radius is as far as another vehicle can be and still block a cell of
+// the VO grid within VORasterizer::kTimeCutoff.
+class VerletLists {
+public:
+    static constexpr float kSkin = 10.0f;       // m, at 30 m/s a rebuild every 10 ticks or so
+    static constexpr float kSpeedSlack = 5.0f;  // m/s headroom over the fastest vehicle at the last build
+
+    std::vector<std::vector<uint32_t>> m_lists; // per vehicle, in index order
+    uint64_t    m_numBuilds = 0;
+
+    void Invalidate() {
+        m_valid = false;
+    }
+
+    // rebuilds if needed, true if it did
+    bool Update(const std::vector<Vehicle>& vehicles, ThreadPool& pool) {
+        if (IsValid(vehicles)) {
+            return false;
+        }
+        Build(vehicles, pool);
+        return true;
+    }
+
+private:
+    bool IsValid(const std::vector<Vehicle>& vehicles) const {
+        if (!m_valid || vehicles.size() != m_anchors.size()) {
+            return false;
+        }
+        const float halfSkinSqr = 0.25f * kSkin * kSkin;
+        for (size_t i = 0; i < vehicles.size(); ++i) {
+            const Vehicle& v = vehicles[i];
+            const Vec2D d = Sub(v.m_pos, m_anchors[i]);
+            if (Dot(d, d) > halfSkinSqr || Dot(v.m_v, v.m_v) > m_maxSpeed * m_maxSpeed || v.BoundingRadius() > m_maxRadius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64_t CellKey(int cx, int cy) {
+        return (uint64_t(uint32_t(cy)) << 32) | uint32_t(cx);
+    }
+
+    void Build(const std::vector<Vehicle>& vehicles, ThreadPool& pool) {
+        const size_t numVehicles = vehicles.size();
+        m_maxSpeed = 0.0f;
+        m_maxRadius = 0.0f;
+        m_anchors.resize(numVehicles);
+        for (size_t i = 0; i < numVehicles; ++i) {
+            m_maxSpeed = std::max(m_maxSpeed, Length(vehicles[i].m_v));
+            m_maxRadius = std::max(m_maxRadius, vehicles[i].BoundingRadius());
+            m_anchors[i] = vehicles[i].m_pos;
+        }
+        m_maxSpeed += kSpeedSlack;
+        const float listRadius = 2.0f * m_maxRadius +
+            VORasterizer::kTimeCutoff * (VORasterizer::MaxGridSpeed() + m_maxSpeed) + kSkin;
+
+        // bucket into cells of listRadius, so everything listed is in the 3x3 cells round a vehicle
+        const float invCell = 1.0f / listRadius;
+        auto cellOf = [&](const Vec2D& p, int& cx, int& cy) {
+            cx = int(floorf(p.x * invCell));
+            cy = int(floorf(p.y * invCell));
+        };
+        m_cells.resize(numVehicles);
+        for (size_t i = 0; i < numVehicles; ++i) {
+            int cx, cy;
+            cellOf(m_anchors[i], cx, cy);
+            m_cells[i] = std::make_pair(CellKey(cx, cy), uint32_t(i));
+        }
+        std::sort(m_cells.begin(), m_cells.end());
+
+        m_lists.resize(numVehicles);
+        const float listRadiusSqr = listRadius * listRadius;
+        pool.ParallelFor(numVehicles, 64, [&](size_t begin, size_t end, unsigned) {
+            for (size_t i = begin; i < end; ++i) {
+                std::vector<uint32_t>& list = m_lists[i];
+                list.clear();
+                int cx, cy;
+                cellOf(m_anchors[i], cx, cy);
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        const uint64_t key = CellKey(cx + dx, cy + dy);
+                        auto it = std::lower_bound(m_cells.begin(), m_cells.end(), std::make_pair(key, uint32_t(0)));
+                        for (; it != m_cells.end() && it->first == key; ++it) {
+                            const uint32_t j = it->second;
+                            const Vec2D d = Sub(m_anchors[j], m_anchors[i]);
+                            if (j != i && Dot(d, d) <= listRadiusSqr) {
+                                list.push_back(j);
+                            }
+                        }
+                    }
+                }
+                std::sort(list.begin(), list.end());
+            }
+        });
+        m_valid = true;
+        ++m_numBuilds;
+    }
+
+    bool                                    m_valid = false;
+    float                                   m_maxSpeed = 0.0f;      // m/s the lists hold for
+    float                                   m_maxRadius = 0.0f;
+    std::vector<Vec2D>                      m_anchors;              // positions at the last build
+    std::vector<std::pair<uint64_t, uint32_t>> m_cells;             // (cell, vehicle) sorted
+};
+
+static const char* const kDefaultScenario = "./scenarios/straight/single file/slow car.json";
+
+// What a scenario file sets up. Map paths are relative to the working directory, empty for the default.
+struct Scenario
+{
+    static const size_t kMaxName = 128;
+    static const size_t kMaxPath = 260;
+
+    char                    name[kMaxName] = {};
+    char                    driveableMap[kMaxPath] = {};
+    char                    laneMap[kMaxPath] = {};
+    std::vector<Vehicle>    vehicles;
+
+    const char* MapFilename() const {
+        return driveableMap[0] ? driveableMap : kDefaultMap;
+    }
+
+    // the scene used before there were scenario files: a parked car and one orbiting it
+    static Scenario Test() {
+        Scenario s;
+        strcpy(s.name, "test");
+        s.vehicles.push_back(Vehicle(50.0f, 100.0f, 0.0f));
+        s.vehicles.push_back(Vehicle());
+        return s;
+    }
+};
+
+// Fills a Scenario from JSON5 events. Unknown keys and values of the wrong type are skipped.
+// velocity is m/s and kept by vehicles that don't orbit. The parser itself doesn't allocate, but each vehicle
+// is a push_back onto Scenario::vehicles.
+//
+// {
+//     name: "...",
+//     vehicles: [ { position: [x, y], rotation: degrees, velocity: [x, y], radius: m, orbit: bool, destination: lane id,
+//                   shape: "circle" | "capsule" | "box", length: m, width: m, max_accel: m/s^2, max_turn_rate: degrees/s }, ... ],
+//     maps: { driveable: "path", lane: "path" },
+// }
+class ScenarioHandler {
+public:
+    explicit ScenarioHandler(Scenario& scenario)
+    : m_scenario(scenario)
+    {
+    }
+
+    bool OnBeginObject() {
+        ++m_depth;
+        if (m_depth == 3 && m_section == kVehicles) {
+            m_scenario.vehicles.push_back(Vehicle(0.0f, 0.0f, 0.0f));
+            m_field = kNone;
+            m_shape = Vehicle::kCircle;
+            m_length = 0.0f;
+            m_width = 0.0f;
+        }
+        return true;
+    }
+
+    bool OnEndObject() {
+        if (m_depth == 3 && m_section == kVehicles && !m_scenario.vehicles.empty()) {
+            // the size can come before the radius
+            m_scenario.vehicles.back().SetShape(m_shape, m_length, m_width);
+        }
+        --m_depth;
+        return true;
+    }
+
+    bool OnBeginArray() {
+        ++m_depth;
+        m_index = 0;
+        return true;
+    }
+
+    bool OnEndArray() {
+        --m_depth;
+        return true;
+    }
+
+    bool OnKey(const Json5String& key) {
+        if (m_depth == 1) {
+            m_section = Json5Equals(key, "name") ? kName : Json5Equals(key, "vehicles") ? kVehicles : Json5Equals(key, "maps") ? kMaps : kNone;
+        } else if (m_depth == 2 && m_section == kMaps) {
+            m_field = Json5Equals(key, "driveable") ? kDriveable : Json5Equals(key, "lane") ? kLane : kNone;
+        } else if (m_depth == 3 && m_section == kVehicles) {
+            m_field = Json5Equals(key, "position") ? kPosition : Json5Equals(key, "velocity") ? kVelocity :
+                Json5Equals(key, "rotation") ? kRotation : Json5Equals(key, "radius") ? kRadius :
+                Json5Equals(key, "orbit") ? kOrbit : Json5Equals(key, "destination") ? kDestination :
+                Json5Equals(key, "shape") ? kShape : Json5Equals(key, "length") ? kLength : Json5Equals(key, "width") ? kWidth :
+                Json5Equals(key, "max_accel") ? kMaxAccel : Json5Equals(key, "max_turn_rate") ? kMaxTurnRate : kNone;
+        }
+        return true;
+    }
+
+    bool OnString(const Json5String& s) {
+        if (m_depth == 1 && m_section == kName) {
+            Json5Unescape(s, m_scenario.name, sizeof(m_scenario.name));
+        } else if (m_depth == 2 && m_section == kMaps && m_field == kDriveable) {
+            Json5Unescape(s, m_scenario.driveableMap, sizeof(m_scenario.driveableMap));
+        } else if (m_depth == 2 && m_section == kMaps && m_field == kLane) {
+            Json5Unescape(s, m_scenario.laneMap, sizeof(m_scenario.laneMap));
+        } else if (m_depth == 3 && m_section == kVehicles && m_field == kShape) {
+            m_shape = Json5Equals(s, "capsule") ? Vehicle::kCapsule : Json5Equals(s, "box") ? Vehicle::kBox : Vehicle::kCircle;
+        }
+        return true;
+    }
+
+    bool OnNumber(double v) {
+        if (m_section != kVehicles || m_scenario.vehicles.empty()) {
+            return true;
+        }
+        Vehicle& vehicle = m_scenario.vehicles.back();
+        if (m_depth == 3 && m_field == kRotation) {
+            vehicle.m_rot = float(v);
+        } else if (m_depth == 3 && m_field == kRadius) {
+            vehicle.m_radius = float(v);
+        } else if (m_depth == 3 && m_field == kLength) {
+            m_length = float(v);
+        } else if (m_depth == 3 && m_field == kWidth) {
+            m_width = float(v);
+        } else if (m_depth == 3 && m_field == kMaxAccel) {
+            vehicle.m_maxAccel = float(v);
+        } else if (m_depth == 3 && m_field == kMaxTurnRate) {
+            vehicle.m_maxTurnRate = float(v);
+        } else if (m_depth == 3 && m_field == kDestination && v >= 0.0 && v <= 255.0) {
+            vehicle.m_destination = uint8_t(v);
+        } else if (m_depth == 4 && (m_field == kPosition || m_field == kVelocity) && m_index < 2) {
+            Vec2D& vec = (m_field == kPosition) ? vehicle.m_pos : vehicle.m_v;
+            (m_index == 0 ? vec.x : vec.y) = float(v);
+            ++m_index;
+        }
+        return true;
+    }
+
+    bool OnBool(bool b) {
+        if (m_depth == 3 && m_section == kVehicles && m_field == kOrbit && !m_scenario.vehicles.empty()) {
+            m_scenario.vehicles.back().m_orbit = b;
+        }
+        return true;
+    }
+
+    bool OnNull() {
+        return true;
+    }
+
+private:
+    enum Key {
+        kNone,
+        kName, kVehicles, kMaps,                                    // top level
+        kDriveable, kLane,                                          // maps
+        kPosition, kVelocity, kRotation, kRadius, kOrbit, kDestination, // vehicles
+        kShape, kLength, kWidth, kMaxAccel, kMaxTurnRate,
+    };
+
+    Scenario&   m_scenario;
+    int         m_depth = 0;        // 1 inside the top level object
+    Key         m_section = kNone;
+    Key         m_field = kNone;
+    int         m_index = 0;        // element of the current [x, y]
+    Vehicle::Shape m_shape = Vehicle::kCircle;  // of the current vehicle, applied at its end
+    float       m_length = 0.0f;
+    float       m_width = 0.0f;
+};
+
+// Parse a scenario held in memory
+static inline bool ParseScenario(const char* text, size_t size, Scenario& out, Json5Error* error = nullptr)
+{
+    out = Scenario();
+    ScenarioHandler handler(out);
+    return ParseJson5(text, size, handler, error);
+}
+
+// buffer is scratch for the file contents, pass the same one in to avoid reallocating
+static inline bool LoadScenario(const char* filename, Scenario& out, std::vector<char>& buffer, Json5Error* error = nullptr)
+{
+    size_t size = 0;
+    if (!ReadWholeFile(filename, buffer, size)) {
+        if (error) {
+            *error = Json5Error();
+            error->message = "can't read file";
+        }
+        return false;
+    }
+    return ParseScenario(buffer.data(), size, out, error);
+}
+
+// Every *.json in dir, in name order, read and parsed in parallel with one file buffer per worker.
+// out[i] belongs to files[i], ok[i] says whether it loaded.
+static inline bool LoadScenarioDirectory(const char* dir, ThreadPool& pool, std::vector<std::string>& files,
+    std::vector<Scenario>& out, std::vector<uint8_t>& ok)
+{
+    if (!ListFiles(dir, ".json", files)) {
+        return false;
+    }
+    out.assign(files.size(), Scenario());
+    ok.assign(files.size(), 0);
+    std::vector<std::vector<char>> buffers(pool.NumThreads());
+    const size_t kFilesPerJob = 16;
+    pool.ParallelFor(files.size(), kFilesPerJob, [&](size_t begin, size_t end, unsigned worker) {
+        std::string path;
+        for (size_t i = begin; i < end; ++i) {
+            path.assign(dir);
+            path += '/';
+            path += files[i];
+            ok[i] = LoadScenario(path.c_str(), out[i], buffers[worker]) ? 1 : 0;
+        }
+    });
+    return true;
+}
+
+// Everything needed to carry on a run from a given tick. Taking one is O(1): vehicle storage is shared
+// copy-on-write with the simulator it came from and the static map data is shared outright.
+struct SimulatorSnapshot
+{
+    uint64_t                                seed = 0;
+    uint32_t                                runId = 0;
+    uint32_t                                tick = 0;
+    CowVector<Vehicle>                      vehicles;
+    std::shared_ptr<const DriveableArea>    road;
+    std::shared_ptr<const LaneMap>          lanes;
+    std::shared_ptr<const RouteTable>       routes;
+};
+
+class Simulator {
+public:
+    // the test scenario on the given map
+    explicit Simulator(const char* mapFilename = kDefaultMap)
+    : m_pool(new ThreadPool(m_numThreads))
+    , m_road(std::make_shared<DriveableArea>(*m_pool, mapFilename))
+    {
+        OpenTiledMapIfAny(mapFilename);
+        AddVehicles(Scenario::Test());
+        m_numThreads = m_pool->NumThreads();
+    }
+
+    explicit Simulator(const Scenario& scenario)
+    : m_pool(new ThreadPool(m_numThreads))
+    , m_road(std::make_shared<DriveableArea>(*m_pool, scenario.MapFilename()))
+    {
+        OpenTiledMapIfAny(scenario.MapFilename());
+        if (scenario.laneMap[0]) {
+            SetLanes(std::make_shared<LaneMap>(*m_pool, scenario.laneMap));
+        }
+        AddVehicles(scenario);
+        m_numThreads = m_pool->NumThreads();
+    }
+
+    // Returns straight away and loads the maps on the loader, which must outlive the load.
+    // Update() does nothing until IsReady().
+    Simulator(AssetLoader& loader, const Scenario& scenario)
+    : m_pool(new ThreadPool(m_numThreads))
+    , m_pendingRoad(loader.Load<DriveableArea>(scenario.MapFilename()))
+    {
+        OpenTiledMapIfAny(scenario.MapFilename());
+        if (scenario.laneMap[0]) {
+            m_pendingLanes = loader.Load<LaneMap>(scenario.laneMap);
+        }
+        AddVehicles(scenario);
+        m_numThreads = m_pool->NumThreads();
+    }
+
+    // Fork a branch from a snapshot, nothing is copied until the branch steps.
+    // Branches usually run side by side on their own threads, so they default to a single thread each.
+    explicit Simulator(const SimulatorSnapshot& snapshot, unsigned numThreads = 1)
+    : m_numThreads(numThreads)
+    , m_pool(new ThreadPool(numThreads))
+    {
+        Restore(snapshot);
+        m_numThreads = m_pool->NumThreads();
+    }
+
+    // false while the maps are loading, and for good if the driveable map failed (see MapFailed()).
+    // A lane map that fails to load leaves the run without lanes.
+    bool IsReady() {
+        if (!m_road && IsFutureReady(m_pendingRoad)) {
+            std::shared_ptr<const DriveableArea> road = m_pendingRoad.get();
+            m_pendingRoad = std::shared_future<std::shared_ptr<const DriveableArea>>();
+            if (road->IsLoaded()) {
+                m_road = road;
+            } else {
+                m_mapFailed = true;
+            }
+        }
+        if (IsFutureReady(m_pendingLanes)) {
+            std::shared_ptr<const LaneMap> lanes = m_pendingLanes.get();
+            m_pendingLanes = std::shared_future<std::shared_ptr<const LaneMap>>();
+            SetLanes(lanes);
+        }
+        return m_road != nullptr && !m_pendingLanes.valid();
+    }
+
+    void SetLanes(const std::shared_ptr<const LaneMap>& lanes) {
+        m_lanes = lanes->IsLoaded() ? lanes : nullptr;
+        m_routes.reset();
+        if (m_lanes) {
+            std::shared_ptr<RouteTable> routes = std::make_shared<RouteTable>();
+            routes->Build(m_lanes->m_graph);
+            m_routes = routes;
+        }
+    }
+
+    // Close a lane to routing, or open it again. Snapshots keep the table they were taken with,
+    // so this copies it first; the table itself only re-solves the destinations affected.
+    void BlockLane(uint8_t lane, bool blocked) {
+        if (!m_routes || m_routes->IsBlocked(lane) == blocked) {
+            return;
+        }
+        std::shared_ptr<RouteTable> routes = std::make_shared<RouteTable>(*m_routes);
+        if (blocked) {
+            routes->Block(lane);
+        } else {
+            routes->Unblock(lane);
+        }
+        m_routes = routes;
+    }
+
+    bool MapFailed() const { return m_mapFailed; }
+
+    void AddVehicles(const Scenario& scenario) {
+        for (const auto& v : scenario.vehicles) {
+            m_indexOf.push_back(uint32_t(m_vehicles.size()));
+            m_vehicles.push_back(v);
+            m_vehicles.Mutable().back().m_id = uint32_t(m_vehicles.size() - 1);
+        }
+        ResizeRasters();
+    }
+
+    // one per handle, the debug view shows handle 0's
+    void ResizeRasters() {
+        m_velocityObstacles.resize(m_vehicles.size());
+        if (!m_velocityObstacles.empty()) {
+            m_velocityObstacles[0].m_keepProbability = true;
+        }
+    }
+
+    // Vehicles are addressed by handle (Vehicle::m_id) outside a tick, their storage order changes with ReorderVehicles()
+    size_t IndexOf(uint32_t handle) const {
+        return m_indexOf[handle];
+    }
+
+    const Vehicle& VehicleByHandle(uint32_t handle) const {
+        return m_vehicles[m_indexOf[handle]];
+    }
+
+    // a scenario can have none, so check before using vehicle 0
+    size_t NumVehicles() const {
+        return m_indexOf.size();
+    }
+
+    // Sort vehicle storage along a Z-order curve over their positions so vehicles near each other in the world
+    // are near each other in memory. Results don't change, everything order dependent goes by handle.
+    void ReorderVehicles() {
+        std::vector<Vehicle>& vehicles = m_vehicles.Mutable();
+        const size_t numVehicles = vehicles.size();
+        if (numVehicles < 2) {
+            return;
+        }
+        Vec2D lo = vehicles[0].m_pos;
+        Vec2D hi = lo;
+        for (const auto& v : vehicles) {
+            lo = Vec2D(std::min(lo.x, v.m_pos.x), std::min(lo.y, v.m_pos.y));
+            hi = Vec2D(std::max(hi.x, v.m_pos.x), std::max(hi.y, v.m_pos.y));
+        }
+        const float scale = 65535.0f / std::max(std::max(hi.x - lo.x, hi.y - lo.y), 1.0f);
+        // (code, handle) so equal codes still sort the same way every time
+        m_reorderKeys.resize(numVehicles);
+        for (size_t i = 0; i < numVehicles; ++i) {
+            const Vehicle& v = vehicles[i];
+            const uint32_t code = MortonCode(uint32_t((v.m_pos.x - lo.x) * scale), uint32_t((v.m_pos.y - lo.y) * scale));
+            m_reorderKeys[i] = std::make_pair((uint64_t(code) << 32) | v.m_id, uint32_t(i));
+        }
+        std::sort(m_reorderKeys.begin(), m_reorderKeys.end());
+
+        std::vector<Vehicle> sorted;
+        sorted.reserve(numVehicles);
+        std::vector<uint32_t> newIndex(numVehicles);
+        for (size_t k = 0; k < numVehicles; ++k) {
+            const uint32_t i = m_reorderKeys[k].second;
+            newIndex[i] = uint32_t(k);
+            m_indexOf[vehicles[i].m_id] = uint32_t(k);
+            sorted.push_back(vehicles[i]);
+        }
+        vehicles.swap(sorted);
+        m_laneNeighbors.Remap(newIndex);
+        m_verletLists.Invalidate();
+        ++m_numReorders;
+    }
+
+    SimulatorSnapshot Snapshot() const {
+        SimulatorSnapshot s;
+        s.seed = m_seed;
+        s.runId = m_runId;
+        s.tick = m_tick;
+        s.vehicles = m_vehicles;
+        s.road = m_road;
+        s.lanes = m_lanes;
+        s.routes = m_routes;
+        return s;
+    }
+
+    // Rewind (or jump) to a snapshot. Per-tick scratch like the VO maps is rebuilt by the next Update.
+    // A recording stops here, replay files only hold consecutive ticks.
+    void Restore(const SimulatorSnapshot& snapshot) {
+        StopRecording();
+        m_seed = snapshot.seed;
+        m_runId = snapshot.runId;
+        m_tick = snapshot.tick;
+        m_vehicles = snapshot.vehicles;
+        m_road = snapshot.road;
+        m_lanes = snapshot.lanes;
+        m_routes = snapshot.routes;
+        m_verletLists.Invalidate();
+        m_indexOf.resize(m_vehicles.size());
+        for (size_t i = 0; i < m_vehicles.size(); ++i) {
+            m_indexOf[m_vehicles[i].m_id] = uint32_t(i);
+        }
+        ResizeRasters();
+        for (auto& raster : m_velocityObstacles) {
+            raster.InvalidateStaticLayer();
+        }
+    }
+
+    // Results are bit-identical for any thread count: every stage below only writes per-vehicle slots,
+    // each vehicle's VO loop visits obstacles in index order, and the state hash is reduced serially.
+    // They are the same with or without ReorderVehicles() too, the hash and logs go by handle.
+    void SetNumThreads(unsigned numThreads) {
+        if (numThreads != m_pool->NumThreads()) {
+            m_pool.reset(new ThreadPool(numThreads));
+        }
+        m_numThreads = m_pool->NumThreads();
+    }
+
+    // Pure simulation, no GL or ImGui so branches can step on any thread. See DrawDebugUI().
+    void Update() {
+        if (!IsReady()) {
+            return;
+        }
+        const float dt = 1.0f / 60.0f;
+
+        if (m_reorderInterval && m_tick % m_reorderInterval == 0) {
+            ReorderVehicles();
+        }
+        std::vector<Vehicle>& vehicles = m_vehicles.Mutable();
+        const size_t numVehicles = vehicles.size();
+        m_staticKey = StaticKey(vehicles);
+        if (m_broadphase != kAllPairs) {
+            m_verletLists.Update(vehicles, *m_pool);
+        }
+        if (m_lanes && m_broadphase == kLaneNeighbors) {
+            m_laneNeighbors.Update(*m_lanes, vehicles);
+        }
+        if (m_broadphase != kAllPairs) {
+            // Cone geometry once per unordered pair, by the lower index, so the VO stage can mirror it
+            m_candidates.resize(numVehicles);
+            m_pairGeometry.resize(numVehicles);
+            m_pool->ParallelFor(numVehicles, kVehiclesPerJob, [&](size_t begin, size_t end, unsigned) {
+                for (size_t i = begin; i < end; ++i) {
+                    GatherCandidates(vehicles, i, m_candidates[i]);
+                    const std::vector<uint32_t>& candidates = m_candidates[i];
+                    std::vector<PairGeometry>& geometry = m_pairGeometry[i];
+                    geometry.resize(candidates.size());
+                    for (size_t k = 0; k < candidates.size(); ++k) {
+                        if (candidates[k] > i) {
+                            geometry[k] = MakePairGeometry(vehicles[i], vehicles[candidates[k]]);
+                        }
+                    }
+                }
+            });
+        }
+        m_pool->ParallelFor(numVehicles, kVehiclesPerJob, [&](size_t begin, size_t end, unsigned worker) {
+            for (size_t i = begin; i < end; ++i) {
+                UpdateVelocityObstacles(vehicles, i, worker);
+            }
+        });
+        m_culledPairs = 0;
+        m_acceptedPairs = 0;
+        for (const auto& raster : m_velocityObstacles) {
+            m_culledPairs += raster.m_culledPairs;
+            m_acceptedPairs += raster.m_acceptedPairs;
+        }
+        m_totalCulledPairs += m_culledPairs;
+        m_totalAcceptedPairs += m_acceptedPairs;
+
+        // orbits are round vehicle 0, no vehicles means nothing to update
+        const Vec2D center = m_indexOf.empty() ? Vec2D(0.0f, 0.0f) : vehicles[m_indexOf[0]].m_pos;
+        m_pool->ParallelFor(numVehicles, kVehiclesPerJob, [&](size_t begin, size_t end, unsigned worker) {
+            for (size_t i = begin; i < end; ++i) {
+                auto& v = vehicles[i];
+                const Vec2D oldVelocity = v.m_v;
+                v.m_center = center;
+                v.Update(dt);
+                v.m_roadDistance = m_road->SignedDistance(v.m_pos);
+                v.m_offRoad = IsOffRoad(v);
+                if (m_lanes) {
+                    m_lanes->Locate(v.m_pos, v.m_lanePos);
+                    v.m_nextLane = m_routes->NextHop(v.m_lanePos.lane, v.m_destination);
+                }
+                if (m_log) {
+                    const Vec2D dv = Sub(v.m_v, oldVelocity);
+                    if (dv.x * dv.x + dv.y * dv.y > m_velocityJumpThreshold * m_velocityJumpThreshold) {
+                        LogVehicle(worker, LogEvent::kVelocityJump, v.m_id, oldVelocity, v.m_v);
+                    }
+                    if (m_logSamples) {
+                        LogVehicle(worker, LogEvent::kVehicleSample, v.m_id, v.m_pos, v.m_v);
+                    }
+                }
+            }
+        });
+        ++m_tick;
+
+        m_stateHash = HashState();
+        if (m_recordHashes) {
+            m_hashes.push_back(m_stateHash);
+        }
+
+        if (m_recorder) {
+            m_replaySamples.resize(numVehicles);
+            for (size_t i = 0; i < numVehicles; ++i) {
+                const auto& v = vehicles[i];
+                ReplaySample& s = m_replaySamples[v.m_id];
+                s.pos = v.m_pos;
+                s.rot = v.m_rot;
+                s.velocity = v.m_v;
+                s.voVelocity = v.m_voVelocity;
+            }
+            m_recorder->Record(m_tick, m_replaySamples.data(), numVehicles);
+        }
+    }
+
+    // debug windows, call once per frame from the GL thread
+    void DrawDebugUI() {
+        // only the map being looked at is uploaded, vehicle 0's if there is one
+        static bool showDebugImage = true;
+        if (showDebugImage && !m_indexOf.empty())
         {
+            VORasterizer& debugRaster = m_velocityObstacles[0];     // rasters are by handle
+            debugRaster.UpdateDebugTexture();
+
             ImGui::Begin("VelocityObstacle", &showDebugImage);   // Pass a pointer to our bool variable (the window will have a closing button that will clear the bool when clicked)
-            ImTextureID my_tex_id = (ImTextureID) m_velocityObstacles[0].m_texId;
-            float my_tex_w = float(4*m_velocityObstacles[0].kRange);
-            float my_tex_h = float(4*m_velocityObstacles[0].kRange);
+            ImTextureID my_tex_id = (ImTextureID) debugRaster.m_texId;
+            float my_tex_w = float(4*debugRaster.kRange);
+            float my_tex_h = float(4*debugRaster.kRange);
             ImVec2 uv_min = ImVec2(0.0f, 1.0f);                 // Top-left
             ImVec2 uv_max = ImVec2(1.0f, 0.0f);                 // Lower-right
             ImVec4 tint_col = ImVec4(1.0f, 1.0f, 1.0f, 1.0f);   // No tint
@@ -207,19 +1897,696 @@ public:
             ImGui::Image(my_tex_id, ImVec2(my_tex_w, my_tex_h), uv_min, uv_max, tint_col, border_col);
             ImGui::End();
         }
+
+        static bool showSimulation = true;
+        if (showSimulation)
+        {
+            ImGui::Begin("Simulation", &showSimulation);
+            int numThreads = int(m_numThreads);
+            if (ImGui::SliderInt("threads", &numThreads, 1, int(std::max(1u, std::thread::hardware_concurrency())))) {
+                SetNumThreads(unsigned(numThreads));
+            }
+            if (!m_road) {
+                ImGui::Text(m_mapFailed ? "map failed to load" : "loading map...");
+            }
+            ImGui::Text("tick %u  state hash %016llx", m_tick, (unsigned long long)m_stateHash);
+            if (!m_indexOf.empty()) {
+                const Vehicle& vehicle0 = VehicleByHandle(0);
+                ImGui::Text("vehicle 0 road edge %.2fm%s", vehicle0.m_roadDistance, vehicle0.m_offRoad ? " OFF ROAD" : "");
+                if (m_lanes) {
+                    const LanePosition& lp = vehicle0.m_lanePos;
+                    ImGui::Text("vehicle 0 lane %d  s %.1fm  offset %.2fm  next lane %d", int(lp.lane), lp.s, lp.offset, int(vehicle0.m_nextLane));
+                }
+            } else {
+                ImGui::Text("no vehicles");
+            }
+            if (m_lanes) {
+                static int blockLane = 1;
+                ImGui::SliderInt("lane", &blockLane, 1, int(std::max(size_t(2), m_routes->NumLanes())) - 1);
+                ImGui::SameLine();
+                bool blocked = m_routes->IsBlocked(uint8_t(blockLane));
+                if (ImGui::Checkbox("blocked", &blocked)) {
+                    BlockLane(uint8_t(blockLane), blocked);
+                }
+            }
+            int broadphase = int(m_broadphase);
+            ImGui::RadioButton("all pairs", &broadphase, kAllPairs);
+            ImGui::SameLine();
+            ImGui::RadioButton("Verlet lists", &broadphase, kVerletLists);
+            ImGui::SameLine();
+            ImGui::RadioButton("lane neighbours", &broadphase, kLaneNeighbors);
+            m_broadphase = Broadphase(broadphase);
+            if (m_broadphase != kAllPairs) {
+                ImGui::SameLine();
+                ImGui::Text("%llu builds", (unsigned long long)m_verletLists.m_numBuilds);
+            }
+            ImGui::Text("VO pairs culled %llu accepted %llu  (total %llu / %llu)", (unsigned long long)m_culledPairs,
+                (unsigned long long)m_acceptedPairs, (unsigned long long)m_totalCulledPairs, (unsigned long long)m_totalAcceptedPairs);
+            int reorderInterval = int(m_reorderInterval);
+            if (ImGui::SliderInt("reorder every", &reorderInterval, 0, 600, reorderInterval ? "%d ticks" : "never")) {
+                m_reorderInterval = uint32_t(reorderInterval);
+            }
+            if (m_tiles) {
+                ImGui::Text("tiles resident %zu loading %zu  loads %llu evictions %llu", m_tiles->NumResident(), m_tiles->NumPending(),
+                    (unsigned long long)m_tiles->NumLoads(), (unsigned long long)m_tiles->NumEvictions());
+            }
+            if (ImGui::Button("Snapshot")) {
+                m_debugSnapshot = Snapshot();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Restore") && m_debugSnapshot.road) {
+                Restore(m_debugSnapshot);
+            }
+            if (m_debugSnapshot.road) {
+                ImGui::SameLine();
+                ImGui::Text("tick %u", m_debugSnapshot.tick);
+            }
+            ImGui::Checkbox("Static VOs", &m_staticObstacles);
+            ImGui::SameLine();
+            ImGui::Checkbox("cache static", &m_cacheStaticLayer);
+            ImGui::SameLine();
+            ImGui::Checkbox("cone stamps", &m_coneStamps);
+            ImGui::SameLine();
+            ImGui::Checkbox("trajectory VOs", &m_trajectoryVOs);
+            ImGui::SameLine();
+            ImGui::Checkbox("show edges", &m_showRoadEdges);
+            ImGui::SameLine();
+            ImGui::Checkbox("lanes", &m_showLanes);
+            ImGui::PushItemWidth(120.0f);
+            ImGui::SliderFloat("velocity sigma", &m_velocitySigma, 0.0f, 8.0f, m_velocitySigma > 0.0f ? "%.1f m/s" : "exact");
+            ImGui::SameLine();
+            ImGui::SliderFloat("max collision p", &m_maxCollisionProbability, 0.0f, 1.0f, "%.2f");
+            ImGui::SameLine();
+            ImGui::SliderInt("cell size", &m_cellSize, 1, 8, "%d m/s");
+            ImGui::SameLine();
+            ImGui::Checkbox("coverage", &m_coverageVOs);
+            ImGui::Checkbox("dynamic window", &m_dynamicWindow);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(120.0f);
+            ImGui::SliderFloat("window time", &m_windowTime, 1.0f / 60.0f, 2.0f, "%.2f s");
+            ImGui::PopItemWidth();
+            ImGui::PopItemWidth();
+            bool logging = IsLogging();
+            if (ImGui::Checkbox("Log events", &logging)) {
+                if (logging) {
+                    StartLogging("events.d2ev");
+                } else {
+                    StopLogging();
+                }
+            }
+            ImGui::SameLine();
+            ImGui::Checkbox("samples", &m_logSamples);
+            if (m_log) {
+                ImGui::Text("events written %llu dropped %llu", (unsigned long long)m_log->Written(), (unsigned long long)m_log->Dropped());
+            }
+            ImGui::End();
+        }
+    }
+
+    // what the two cones of a vehicle pair share, see VelocityObstacle::ConeEdges. Edges are only set if dist
+    // is more than the radii summed and are for the cone from a to b.
+    struct PairGeometry
+    {
+        float   dist = 0.0f;
+        Vec2D   leftEdgeDir;
+        Vec2D   rightEdgeDir;
+    };
+
+    // Off the lanes, or without them, everything in the neighbour list counts. On a lane the leader, follower and
+    // adjacent gaps stand in for the listed vehicles in this and the adjacent lanes; everything else listed, off the
+    // lanes or on any other lane (successors, predecessors, crossings), still counts. Always in index order.
+    // Not for kAllPairs.
+    void GatherCandidates(const std::vector<Vehicle>& vehicles, size_t i, std::vector<uint32_t>& out) const {
+        out.clear();
+        const auto& a = vehicles[i];
+        const bool useLanes = m_lanes && m_broadphase == kLaneNeighbors && a.m_lanePos.lane != 0 &&
+            i < m_laneNeighbors.m_entries.size();
+        if (!useLanes) {
+            out = m_verletLists.m_lists[i];
+            return;
+        }
+        const LaneNeighbors::Entry& e = m_laneNeighbors.m_entries[i];
+        uint32_t near[2 + 2 * LaneNeighbors::kMaxAdjacent];
+        size_t numNear = 0;
+        auto addNear = [&](uint32_t j) {
+            if (j != LaneNeighbors::kNone) {
+                near[numNear++] = j;
+            }
+        };
+        addNear(e.leader);
+        addNear(e.follower);
+        for (const auto& gap : e.adjacent) {
+            addNear(gap.leader);
+            addNear(gap.follower);
+        }
+        // a handful at most
+        for (size_t m = 1; m < numNear; ++m) {
+            const uint32_t j = near[m];
+            size_t n = m;
+            for (; n > 0 && near[n - 1] > j; --n) {
+                near[n] = near[n - 1];
+            }
+            near[n] = j;
+        }
+        auto coveredLane = [&](uint8_t lane) {
+            if (lane == a.m_lanePos.lane) {
+                return true;
+            }
+            for (const auto& gap : e.adjacent) {
+                if (gap.lane != 0 && gap.lane == lane) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        size_t k = 0;
+        for (uint32_t j : m_verletLists.m_lists[i]) {
+            const uint8_t lane = vehicles[j].m_lanePos.lane;
+            if (lane != 0 && coveredLane(lane)) {
+                continue;
+            }
+            for (; k < numNear && near[k] < j; ++k) {
+                out.push_back(near[k]);
+            }
+            if (k < numNear && near[k] == j) {
+                ++k;
+            }
+            out.push_back(j);
+        }
+        out.insert(out.end(), near + k, near + numNear);
+    }
+
+    static PairGeometry MakePairGeometry(const Vehicle& a, const Vehicle& b) {
+        PairGeometry g;
+        const Vec2D offset = Sub(b.m_pos, a.m_pos);
+        g.dist = Length(offset);
+        const float r = a.m_radius + b.m_radius;
+        if (g.dist > r) {
+            VelocityObstacle::ConeEdges(offset, g.dist, r, g.leftEdgeDir, g.rightEdgeDir);
+        }
+        return g;
+    }
+
+    // VO stage for vehicle i, reads every vehicle but only writes vehicle i and its VO map
+    void UpdateVelocityObstacles(std::vector<Vehicle>& vehicles, size_t i, unsigned worker) {
+        const size_t numVehicles = vehicles.size();
+        const auto& a = vehicles[i];
+        VORasterizer& raster = m_velocityObstacles[a.m_id];
+        raster.ResetCounters();
+        raster.m_useConeStamps = m_coneStamps;
+        raster.SetCellSize(float(m_cellSize));
+        raster.SetCoverage(m_coverageVOs);
+        raster.ResetScissor();
+
+        // Static obstacles are drawn once per cell of kStaticCell metres the vehicle passes through, as seen
+        // from the cell centre. The layer depends only on the cell and m_staticKey, never on when it was built,
+        // so runs stay deterministic whatever the cache held.
+        const int cellX = int(floorf(a.m_pos.x / kStaticCell));
+        const int cellY = int(floorf(a.m_pos.y / kStaticCell));
+        const Vec2D cellCenter((float(cellX) + 0.5f) * kStaticCell, (float(cellY) + 0.5f) * kStaticCell);
+        // grow the vehicle by the furthest it can be from the cell centre so the layer stays conservative
+        const float staticRadius = a.m_radius + 0.5f * float(M_SQRT2) * kStaticCell;
+        // a shaped vehicle's layer also depends on which way it faces
+        const uint64_t layerKey = a.HasCore() ?
+            HashFloat(HashFloat(HashFloat(m_staticKey, a.m_rot), a.m_halfLength), a.m_halfWidth) : m_staticKey;
+        if (m_cacheStaticLayer && raster.HasStaticLayer(cellX, cellY, layerKey)) {
+            raster.LoadStaticLayer();
+        } else {
+            raster.Clear();
+            DrawStaticObstacles(vehicles, i, cellCenter, staticRadius);
+            raster.StoreStaticLayer(cellX, cellY, layerKey);
+        }
+
+        // The static layer covers the whole grid so it can be cached, the rest only what a can reach. The probability
+        // blur reaches about 3 sigma further, so that much more is drawn and the window narrowed again to select.
+        Vec2D windowLo, windowHi;
+        if (m_dynamicWindow) {
+            a.ReachableVelocities(m_windowTime, windowLo, windowHi);
+            const Vec2D pad(3.0f * m_velocitySigma, 3.0f * m_velocitySigma);
+            raster.SetScissor(Sub(windowLo, pad), Add(windowHi, pad));
+        }
+
+        VelocityObstacle::Obstacle va = a.ToObstacle(0.0f);
+        auto drawVehicle = [&](size_t j, const PairGeometry& g) {
+            const auto& b = vehicles[j];
+
+            VelocityObstacle::Obstacle vb = b.ToObstacle(1.0f);
+
+            va.bias = 0.0f; // 0.5f;
+            vb.bias = 1.0f; // 0.5f;
+
+            // capsules and boxes are one hull for the pair, see DrawVehicleHull()
+            Vertex hull[VelocityObstacle::kMaxHull];
+            int numHull = 0;
+            float dist = g.dist;
+            float r_total = va.radius + vb.radius;
+            if (va.HasCore() || vb.HasCore()) {
+                numHull = VehicleHull(va, vb, hull);
+                dist = DistanceToHull(va.position, hull, numHull);
+            }
+            if (dist > r_total) {
+                // CanBlock() takes b to carry on in a straight line, an orbit can curve back towards a from anywhere
+                const bool trajectory = !numHull && m_trajectoryVOs && b.m_orbit;
+                if (InStaticLayer(a, b, cellCenter, staticRadius) ||
+                    !(trajectory || (numHull ? raster.CanBlock(va, vb) : raster.CanBlock(va, vb, dist)))) {
+                    return;
+                }
+                if (numHull) {
+                    DrawHull(raster, va, hull, numHull, r_total, VehicleApex(va, vb), 0);
+                    return;
+                }
+                if (trajectory) {
+                    DrawTrajectoryVO(raster, a, b, dist - r_total);
+                    return;
+                }
+                VelocityObstacle ob(va, vb, g.leftEdgeDir, g.rightEdgeDir);
+                raster.drawTriangle(ob);
+            } else {
+                //TODO: actively colliding...
+                if (m_log) {
+                    LogEvent e = MakeEvent(LogEvent::kCollision, a.m_id);
+                    e.other = b.m_id;
+                    e.a[0] = dist;
+                    e.a[1] = r_total;
+                    m_log->Push(worker, e);
+                }
+            }
+        };
+
+        if (m_broadphase == kAllPairs) {
+            for (size_t j = 0; j < numVehicles; ++j) {
+                if (i != j) {
+                    drawVehicle(j, MakePairGeometry(a, vehicles[j]));
+                }
+            }
+        } else {
+            // the lower index set the pair up, the cone from this side has the same edges negated
+            const std::vector<uint32_t>& candidates = m_candidates[i];
+            for (size_t k = 0; k < candidates.size(); ++k) {
+                const uint32_t j = candidates[k];
+                if (j > i) {
+                    drawVehicle(j, m_pairGeometry[i][k]);
+                    continue;
+                }
+                const std::vector<uint32_t>& others = m_candidates[j];
+                const auto found = std::lower_bound(others.begin(), others.end(), uint32_t(i));
+                if (found != others.end() && *found == i) {
+                    const PairGeometry& g = m_pairGeometry[j][size_t(found - others.begin())];
+                    PairGeometry mirrored;
+                    mirrored.dist = g.dist;
+                    mirrored.leftEdgeDir = Vec2D(-g.leftEdgeDir.x, -g.leftEdgeDir.y);
+                    mirrored.rightEdgeDir = Vec2D(-g.rightEdgeDir.x, -g.rightEdgeDir.y);
+                    drawVehicle(j, mirrored);
+                } else {
+                    // lane neighbours aren't always mutual
+                    drawVehicle(j, MakePairGeometry(a, vehicles[j]));
+                }
+            }
+        }
+        bool selected;
+        if (m_velocitySigma > 0.0f) {
+            raster.BuildProbability(m_velocitySigma);
+            if (m_dynamicWindow) {
+                raster.SetScissor(windowLo, windowHi);
+            }
+            selected = raster.SelectVelocity(a.m_v, vehicles[i].m_voVelocity, m_maxCollisionProbability);
+        } else {
+            selected = raster.SelectVelocity(a.m_v, vehicles[i].m_voVelocity);
+        }
+        if (!selected && m_log) {
+            LogVehicle(worker, LogEvent::kBlockedAll, a.m_id, a.m_v, a.m_v);
+        }
+    }
+
+    // A disc is off road once the edge is nearer its centre than its radius. Boxes and capsules only have their
+    // corner radius round the core, so each end of the core is checked the same way.
+    bool IsOffRoad(const Vehicle& v) const {
+        if (!v.HasCore()) {
+            return v.m_roadDistance > -v.m_radius;
+        }
+        const VelocityObstacle::Obstacle o = v.ToObstacle(0.0f);
+        for (int corner = 0; corner < 4; ++corner) {
+            const Vec2D along = Mult(o.halfLength, (corner & 1) ? 1.0f : -1.0f);
+            const Vec2D across = Mult(o.halfWidth, (corner & 2) ? 1.0f : -1.0f);
+            if (m_road->IsOffRoad(Add(v.m_pos, Add(along, across)), v.m_radius)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // parked vehicles far enough from a's static layer cell centre are in the layer
+    bool InStaticLayer(const Vehicle& a, const Vehicle& b, const Vec2D& cellCenter, float staticRadius) const {
+        return b.IsParked() && Length(Sub(b.m_pos, cellCenter)) > (staticRadius + a.CoreReach()) + b.BoundingRadius();
+    }
+
+    // b's core less a's as a hull, a pair with either shaped is one VO of it grown by the radii summed
+    static int VehicleHull(const VelocityObstacle::Obstacle& a, const VelocityObstacle::Obstacle& b, Vertex* hull) {
+        Vertex corners[4];
+        const int numCorners = b.CoreCorners(corners);
+        return VelocityObstacle::MinkowskiHull(a, corners, numCorners, hull);
+    }
+
+    // VO of b following its predicted path rather than its current velocity, a disc pair gap apart.
+    // Samples are even in 1 / t, from when b could first reach the grid to kTimeCutoff.
+    static void DrawTrajectoryVO(VORasterizer& raster, const Vehicle& a, const Vehicle& b, float gap) {
+        Vec2D positions[kTrajectorySamples];
+        float times[kTrajectorySamples];
+        const float cutoff = VORasterizer::kTimeCutoff;
+        const float first = std::min(std::max(gap / (VORasterizer::MaxGridSpeed() + Length(b.m_v)), kMinTrajectoryTime), cutoff);
+        for (int k = 0; k < kTrajectorySamples; ++k) {
+            const float u = float(k) / float(kTrajectorySamples - 1);
+            times[k] = 1.0f / (1.0f / first + u * (1.0f / cutoff - 1.0f / first));
+            positions[k] = b.PredictPosition(times[k]);
+        }
+        raster.DrawTrajectory(a.m_pos, positions, times, kTrajectorySamples, a.m_radius + b.m_radius);
+    }
+
+    static Vec2D VehicleApex(const VelocityObstacle::Obstacle& a, const VelocityObstacle::Obstacle& b) {
+        return Add(Mult(a.velocity, a.bias), Mult(b.velocity, b.bias));
+    }
+
+    // road edges, trees and parked vehicles as seen by vehicle i standing still at origin
+    void DrawStaticObstacles(const std::vector<Vehicle>& vehicles, size_t i, const Vec2D& origin, float radius) {
+        const Vehicle& a = vehicles[i];
+        VORasterizer& raster = m_velocityObstacles[a.m_id];
+        VelocityObstacle::Obstacle va = a.ToObstacle(0.0f);   // they don't move, the whole avoidance is ours
+        va.position = origin;
+        va.velocity = Vec2D(0.0f, 0.0f);
+        va.radius = radius;
+        if (m_staticObstacles) {
+            // every edge that could be reached at the grid's top speed before the time cutoff
+            const float reach = (radius + a.CoreReach()) + VORasterizer::kTimeCutoff * VORasterizer::MaxGridSpeed();
+            m_road->QueryEdges(origin, reach, [&](uint32_t, const Segment& seg) {
+                DrawStaticSegment(raster, va, seg.a, seg.b, 0);
+            });
+        }
+        for (size_t j = 0; j < vehicles.size(); ++j) {
+            const auto& b = vehicles[j];
+            if (j == i || !InStaticLayer(a, b, origin, radius)) {
+                continue;
+            }
+            VelocityObstacle::Obstacle vb = b.ToObstacle(1.0f);
+            if (!raster.CanBlock(va, vb)) {
+                continue;
+            }
+            if (va.HasCore() || vb.HasCore()) {
+                Vertex hull[VelocityObstacle::kMaxHull];
+                const int numHull = VehicleHull(va, vb, hull);
+                DrawHull(raster, va, hull, numHull, va.radius + vb.radius, VehicleApex(va, vb), 0);
+            } else {
+                VelocityObstacle ob(va, vb);
+                raster.drawTriangle(ob);
+            }
+        }
+    }
+
+    // Everything the static layers depend on besides the cell. Serial, before the VO stage.
+    // Per vehicle hashes are summed so the key doesn't depend on storage order.
+    uint64_t StaticKey(const std::vector<Vehicle>& vehicles) const {
+        uint64_t sum = 0;
+        for (const auto& b : vehicles) {
+            if (b.IsParked()) {
+                uint64_t h = HashWord(kHashOffset, b.m_id);
+                h = HashFloat(h, b.m_pos.x);
+                h = HashFloat(h, b.m_pos.y);
+                h = HashFloat(h, b.m_radius);
+                h = HashFloat(h, b.m_halfLength);
+                h = HashFloat(h, b.m_halfWidth);
+                h = HashFloat(h, b.m_rot);
+                sum += h;
+            }
+        }
+        return HashWord(sum, m_staticObstacles ? 1 : 0);
+    }
+
+    // Static VO for one segment, a capsule round it for a disc or its sum with the core for a shaped vehicle
+    void DrawStaticSegment(VORasterizer& raster, const VelocityObstacle::Obstacle& a, const Vertex& s0, const Vertex& s1, int depth) {
+        const Vertex ends[2] = { s0, s1 };
+        const Vec2D apex = Mult(a.velocity, a.bias);
+        if (!a.HasCore()) {
+            DrawHull(raster, a, ends, 2, a.radius, apex, depth);
+            return;
+        }
+        Vertex hull[VelocityObstacle::kMaxHull];
+        const int numHull = VelocityObstacle::MinkowskiHull(a, ends, 2, hull);
+        DrawHull(raster, a, hull, numHull, a.radius, apex, depth);
+    }
+
+    // VO of a hull grown by radius, split until its cone is comfortably narrower than pi: segments in half, polygons
+    // along a diagonal. The pieces' VOs cover the whole's exactly. Hulls already touching the vehicle are skipped,
+    // the off road flag and collision events cover those.
+    void DrawHull(VORasterizer& raster, const VelocityObstacle::Obstacle& a, const Vertex* hull, int numHull, float radius,
+                  const Vec2D& apex, int depth) {
+        if (DistanceToHull(a.position, hull, numHull) <= radius) {
+            return;
+        }
+        VelocityObstacle ob(a, hull, numHull, radius, apex);
+        if (ob.m_coneSpread > kMaxStaticConeSpread && depth < kMaxStaticSplits && numHull > 1) {
+            if (numHull == 2) {
+                const Vertex mid = Mult(Add(hull[0], hull[1]), 0.5f);
+                const Vertex first[2] = { hull[0], mid };
+                const Vertex second[2] = { mid, hull[1] };
+                DrawHull(raster, a, first, 2, radius, apex, depth + 1);
+                DrawHull(raster, a, second, 2, radius, apex, depth + 1);
+                return;
+            }
+            // a triangle gets a midpoint so both halves are smaller
+            Vertex points[VelocityObstacle::kMaxHull + 1];
+            int n = 0;
+            points[n++] = hull[0];
+            if (numHull == 3) {
+                points[n++] = Mult(Add(hull[0], hull[1]), 0.5f);
+            }
+            for (int k = 1; k < numHull; ++k) {
+                points[n++] = hull[k];
+            }
+            const int k = n / 2;
+            Vertex second[VelocityObstacle::kMaxHull];
+            std::copy(points + k, points + n, second);
+            second[n - k] = points[0];
+            DrawHull(raster, a, points, k + 1, radius, apex, depth + 1);
+            DrawHull(raster, a, second, n - k + 1, radius, apex, depth + 1);
+            return;
+        }
+        raster.drawTriangle(ob);
+    }
+
+    bool StartLogging(const char* filename) {
+        m_log.reset(new EventLog(filename));
+        if (!m_log->IsOpen()) {
+            m_log.reset();
+            return false;
+        }
+        return true;
+    }
+
+    // waits for the writer to drain what's queued
+    void StopLogging() {
+        m_log.reset();
+    }
+
+    bool IsLogging() const {
+        return m_log != nullptr;
+    }
+
+    LogEvent MakeEvent(LogEvent::Type type, size_t vehicle) const {
+        LogEvent e = {};
+        e.type = type;
+        e.tick = m_tick;
+        e.vehicle = uint32_t(vehicle);
+        return e;
+    }
+
+    void LogVehicle(unsigned worker, LogEvent::Type type, size_t vehicle, const Vec2D& a, const Vec2D& b) {
+        LogEvent e = MakeEvent(type, vehicle);
+        e.a[0] = a.x;
+        e.a[1] = a.y;
+        e.b[0] = b.x;
+        e.b[1] = b.y;
+        m_log->Push(worker, e);
+    }
+
+    // Cheap hash of the simulated state in handle order, compare between runs to find the first tick that diverges.
+    uint64_t HashState() const {
+        uint64_t h = kHashOffset;
+        h = HashWord(h, m_tick);
+        for (uint32_t index : m_indexOf) {
+            h = m_vehicles[index].HashState(h);
+        }
+        return h;
+    }
+
+    bool StartRecording(const char* filename) {
+        m_recorder.reset(new ReplayWriter(filename));
+        if (!m_recorder->IsOpen()) {
+            m_recorder.reset();
+            return false;
+        }
+        return true;
+    }
+
+    // flushes the background writer and finishes the file
+    void StopRecording() {
+        m_recorder.reset();
+    }
+
+    bool IsRecording() const {
+        return m_recorder != nullptr;
+    }
+
+    // Show a recorded tick instead of simulating one, vehicles are matched by handle.
+    void ApplyReplayFrame(uint32_t tick, const std::vector<ReplaySample>& samples) {
+        std::vector<Vehicle>& vehicles = m_vehicles.Mutable();
+        const size_t count = std::min(samples.size(), vehicles.size());
+        for (size_t i = 0; i < count; ++i) {
+            auto& v = vehicles[m_indexOf[i]];
+            const ReplaySample& s = samples[i];
+            v.m_pos = s.pos;
+            v.m_rot = s.rot;
+            v.m_v = s.velocity;
+            v.m_voVelocity = s.voVelocity;
+        }
+        m_tick = tick;
+    }
+
+    // returns the first tick whose recorded hash differs from reference, or -1 if they agree
+    int FindDivergence(const std::vector<uint64_t>& reference) const {
+        size_t count = std::min(reference.size(), m_hashes.size());
+        for (size_t t = 0; t < count; ++t) {
+            if (reference[t] != m_hashes[t]) {
+                return int(t);
+            }
+        }
+        return -1;
+    }
+
+    // Stream the map from a tiled file instead of drawing the road texture.
+    // Done for you when the simulation's own map is a .d2tiles, which is how a tiled map is simulated as well as drawn.
+    bool OpenTiledMap(const char* filename) {
+        m_tiles.reset(new TiledMap());
+        if (!m_tiles->Open(filename)) {
+            m_tiles.reset();
+            return false;
+        }
+        return true;
+    }
+
+    void OpenTiledMapIfAny(const char* mapFilename) {
+        if (DriveableArea::IsTiledFilename(mapFilename)) {
+            OpenTiledMap(mapFilename);
+        }
+    }
+
+    // GL thread, once per frame: keep the tiles round the camera and every vehicle resident
+    void UpdateTiles(const Vec2D& camera, float viewRadius) {
+        if (!m_tiles) {
+            return;
+        }
+        m_tilePoints.clear();
+        m_tilePoints.push_back(camera);
+        for (const auto& v : m_vehicles) {
+            m_tilePoints.push_back(v.m_pos);
+        }
+        m_tiles->Update(m_tilePoints.data(), m_tilePoints.size(), std::max(viewRadius, kTileMargin));
     }
 
     void Render() {
-        m_road.Render();
-        m_lane.Render();
-        for (auto& v : m_vehicles) {
+        if (m_tiles) {
+            m_tiles->Render();
+        } else if (m_road) {
+            m_road->Render();
+        }
+        if (m_showRoadEdges && m_road) {
+            m_road->RenderEdges();
+        }
+        if (m_showLanes && m_lanes) {
+            m_lanes->Render();
+        }
+        for (const auto& v : m_vehicles) {
             v.Render();
         }
     }
 
-    DriveableArea                   m_road;
-    Lane                            m_lane;
-    std::vector<Vehicle>            m_vehicles;
+    // Random numbers for a vehicle (by handle) this tick, the same values come back for any thread count or update order.
+    // Vary m_runId between runs of a batch and keep m_seed fixed to get independent but repeatable runs.
+    RandomStream Random(uint32_t handle) const {
+        return RandomStream(m_seed, m_runId, handle, m_tick);
+    }
+
+    // how vehicles find the others worth drawing into their VO maps
+    enum Broadphase {
+        kAllPairs,          // every vehicle against every other
+        kVerletLists,       // every vehicle near enough to matter, see VerletLists
+        kLaneNeighbors,     // leader, follower and adjacent lane gaps when there are lanes, see LaneNeighbors,
+                            // Verlet lists for anything off the lanes or on conflicting ones
+    };
+
+    static const size_t kVehiclesPerJob = 16;
+    static constexpr float kTileMargin = 100.0f;    // m round each vehicle and the camera to keep streamed in
+    static constexpr float kStaticCell = 0.5f;  // m, static VO layers are rebuilt when a vehicle changes cell
+    static constexpr float kMaxStaticConeSpread = 0.9f * float(M_PI);
+    static const int kMaxStaticSplits = 6;
+    static const int kTrajectorySamples = 16;
+    static constexpr float kMinTrajectoryTime = 1e-3f;  // s
+
+    uint64_t                        m_seed = 0;
+    uint32_t                        m_runId = 0;
+    uint32_t                        m_tick = 0;
+
+    unsigned                        m_numThreads = 0;   // 0 = all hardware threads
+    std::unique_ptr<ThreadPool>     m_pool;
+
+    uint64_t                        m_stateHash = 0;
+    bool                            m_recordHashes = false;
+    std::vector<uint64_t>           m_hashes;           // one per tick when m_recordHashes is set
+
+    bool                            m_staticObstacles = true;   // road edges and trees go into the VO maps
+    bool                            m_cacheStaticLayer = true;
+    bool                            m_coneStamps = true;    // see ConeStampTable, same maps either way
+    bool                            m_trajectoryVOs = false;    // orbiting vehicles' VOs follow their path, see DrawTrajectoryVO()
+    float                           m_velocitySigma = 0.0f; // m/s of velocity uncertainty, > 0 picks velocities from VORasterizer::BuildProbability()
+    float                           m_maxCollisionProbability = 0.1f;
+    int                             m_cellSize = 1;         // m/s per VO map cell, 4 for 32x32 maps
+    bool                            m_coverageVOs = false;  // VO maps hold the area of each cell left free, see VORasterizer::DrawCoverage()
+    bool                            m_dynamicWindow = false;    // vehicles' VOs only drawn where Vehicle::ReachableVelocities() allows
+    float                           m_windowTime = 0.5f;    // s the dynamic window allows for reaching a velocity
+    uint64_t                        m_staticKey = 0;
+    bool                            m_showRoadEdges = false;
+    bool                            m_showLanes = true;
+    Broadphase                      m_broadphase = kLaneNeighbors;
+    LaneNeighbors                   m_laneNeighbors;    // rebuilt incrementally each tick with kLaneNeighbors
+    VerletLists                     m_verletLists;      // rebuilt every few ticks unless kAllPairs
+    std::vector<std::vector<uint32_t>>      m_candidates;   // per vehicle index, sorted, rebuilt each tick unless kAllPairs
+    std::vector<std::vector<PairGeometry>>  m_pairGeometry; // parallel to m_candidates, set where the candidate's index is higher
+    uint64_t                        m_culledPairs = 0;      // last tick, vehicle pairs rejected before VO setup
+    uint64_t                        m_acceptedPairs = 0;    // and the ones set up and drawn
+    uint64_t                        m_totalCulledPairs = 0;
+    uint64_t                        m_totalAcceptedPairs = 0;
+    uint32_t                        m_reorderInterval = 0;  // ticks between ReorderVehicles(), 0 for never
+    uint64_t                        m_numReorders = 0;
+    std::vector<std::pair<uint64_t, uint32_t>> m_reorderKeys;
+
+    std::unique_ptr<EventLog>       m_log;
+    bool                            m_logSamples = false;       // a kVehicleSample per vehicle per tick
+    float                           m_velocityJumpThreshold = 2.0f; // m/s change in one tick
+
+    std::unique_ptr<ReplayWriter>   m_recorder;
+    std::vector<ReplaySample>       m_replaySamples;
+
+    SimulatorSnapshot               m_debugSnapshot;
+
+    std::unique_ptr<TiledMap>       m_tiles;
+    std::vector<Vec2D>              m_tilePoints;
+
+    std::shared_ptr<const DriveableArea> m_road;    // static, shared by every snapshot and fork, null until loaded
+    std::shared_future<std::shared_ptr<const DriveableArea>> m_pendingRoad;
+    bool                            m_mapFailed = false;
+    std::shared_ptr<const LaneMap>  m_lanes;    // null without a lane map
+    std::shared_future<std::shared_ptr<const LaneMap>> m_pendingLanes;
+    std::shared_ptr<const RouteTable> m_routes;     // over m_lanes->m_graph, null without lanes
+    CowVector<Vehicle>              m_vehicles;
+    std::vector<uint32_t>           m_indexOf;          // handle to index in m_vehicles
 
-    std::vector<VORasterizer>       m_velocityObstacles;
+    std::vector<VORasterizer>       m_velocityObstacles;    // by handle, they don't move when vehicles are reordered
 };
\ No newline at end of file
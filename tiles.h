@@ -0,0 +1,432 @@
+#pragma once
+
+// Tiled world maps, streamed in around whatever is being looked at.
+//
+// A map image is cut into square tiles of raw RGBA, stored behind an offset table so any tile can be found
+// without reading the others. TiledMap memory maps the file, a loader thread copies requested tiles out of the
+// mapping (which is where the disk reads happen) and the GL thread uploads finished tiles to textures.
+// Resident tiles are kept in LRU order and the least recently used ones outside the working set are
+// evicted once there are more than the cache capacity, so memory stays bounded however big the map is.
+//
+// file := Header TileEntry[tilesX * tilesY] tile data
+// Tiles are row major from the tile at world (0, 0), rows within a tile also start at the low y edge,
+// the same as image rows in DriveableArea. Tiles on the right and top edges are padded with transparent pixels.
+// The simulation reads the same file through TiledMapFile, see DriveableArea::LoadTiled().
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "geom.h"
+#include "platform.h"
+
+struct TiledMapFormat
+{
+    static const uint32_t kMagic = 0x4c543244;      // "D2TL"
+    static const uint32_t kVersion = 1;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t tileSize;      // pixels along a side, a pixel is a metre
+        uint32_t width;         // whole map in pixels
+        uint32_t height;
+        uint32_t tilesX;
+        uint32_t tilesY;
+        uint32_t pad;
+    };
+
+    struct TileEntry {
+        uint64_t offset;        // 0 for a tile with nothing on it
+        uint64_t size;
+    };
+};
+
+// Cut an RGBA image into a tiled map file. Fully transparent tiles aren't stored.
+static inline bool WriteTiledMap(const char* filename, const unsigned char* rgba, int width, int height, int tileSize)
+{
+    if (width <= 0 || height <= 0 || tileSize <= 0) {
+        return false;
+    }
+    FILE* f = OpenFile(filename, "wb");
+    if (!f) {
+        return false;
+    }
+    TiledMapFormat::Header header;
+    header.magic = TiledMapFormat::kMagic;
+    header.version = TiledMapFormat::kVersion;
+    header.tileSize = uint32_t(tileSize);
+    header.width = uint32_t(width);
+    header.height = uint32_t(height);
+    header.tilesX = uint32_t((width + tileSize - 1) / tileSize);
+    header.tilesY = uint32_t((height + tileSize - 1) / tileSize);
+    header.pad = 0;
+
+    const size_t numTiles = size_t(header.tilesX) * header.tilesY;
+    const size_t tileBytes = size_t(tileSize) * tileSize * 4;
+    std::vector<TiledMapFormat::TileEntry> table(numTiles);
+    std::vector<unsigned char> tile(tileBytes);
+    uint64_t offset = sizeof(header) + numTiles * sizeof(TiledMapFormat::TileEntry);
+
+    // table first so the tiles can be streamed straight after it, it is rewritten at the end
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(table.data(), sizeof(TiledMapFormat::TileEntry), numTiles, f) == numTiles;
+    for (uint32_t ty = 0; ok && ty < header.tilesY; ++ty) {
+        for (uint32_t tx = 0; ok && tx < header.tilesX; ++tx) {
+            std::fill(tile.begin(), tile.end(), 0);
+            bool empty = true;
+            for (int y = 0; y < tileSize; ++y) {
+                const int sy = int(ty) * tileSize + y;
+                const int x0 = int(tx) * tileSize;
+                if (sy >= height) {
+                    break;
+                }
+                const int count = std::min(tileSize, width - x0);
+                const unsigned char* src = rgba + (size_t(sy) * width + x0) * 4;
+                memcpy(&tile[size_t(y) * tileSize * 4], src, size_t(count) * 4);
+                for (int x = 0; x < count && empty; ++x) {
+                    empty = src[x * 4 + 3] == 0;
+                }
+            }
+            if (empty) {
+                continue;
+            }
+            TiledMapFormat::TileEntry& e = table[size_t(ty) * header.tilesX + tx];
+            e.offset = offset;
+            e.size = tileBytes;
+            ok = fwrite(tile.data(), 1, tileBytes, f) == tileBytes;
+            offset += tileBytes;
+        }
+    }
+    ok = ok && fseek(f, long(sizeof(header)), SEEK_SET) == 0;
+    ok = ok && fwrite(table.data(), sizeof(TiledMapFormat::TileEntry), numTiles, f) == numTiles;
+    fclose(f);
+    return ok;
+}
+
+// The file half of TiledMap without any GL: the mapping, checked header and tile table. Reads are safe from any
+// thread once it is open, DriveableArea builds the simulation's per tile layers from it.
+class TiledMapFile {
+public:
+    static const uint32_t kMaxTileSize = 8192;
+
+    bool Open(const char* filename) {
+        Close();
+        if (!m_map.Open(filename) || m_map.Size() < sizeof(TiledMapFormat::Header)) {
+            return false;
+        }
+        memcpy(&m_header, m_map.Data(), sizeof(m_header));
+        const uint32_t size = m_header.tileSize;
+        if (m_header.magic != TiledMapFormat::kMagic || m_header.version != TiledMapFormat::kVersion ||
+            size == 0 || size > kMaxTileSize || m_header.width == 0 || m_header.height == 0 ||
+            m_header.width > uint32_t(INT32_MAX) || m_header.height > uint32_t(INT32_MAX) ||
+            m_header.tilesX != uint32_t((uint64_t(m_header.width) + size - 1) / size) ||
+            m_header.tilesY != uint32_t((uint64_t(m_header.height) + size - 1) / size)) {
+            Close();
+            return false;
+        }
+        const size_t numTiles = size_t(m_header.tilesX) * m_header.tilesY;
+        const size_t tableEnd = sizeof(m_header) + numTiles * sizeof(TiledMapFormat::TileEntry);
+        if (tableEnd > m_map.Size()) {
+            Close();
+            return false;
+        }
+        m_table.resize(numTiles);
+        memcpy(m_table.data(), m_map.Data() + sizeof(m_header), numTiles * sizeof(TiledMapFormat::TileEntry));
+        for (const auto& e : m_table) {
+            if (e.offset != 0 && (e.offset > m_map.Size() || e.size > m_map.Size() - e.offset || e.size != TileBytes())) {
+                Close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Close() {
+        m_table.clear();
+        m_map.Close();
+        m_header = TiledMapFormat::Header();
+    }
+
+    bool IsOpen() const { return m_map.IsOpen(); }
+    const TiledMapFormat::Header& Header() const { return m_header; }
+    size_t TileBytes() const { return size_t(m_header.tileSize) * m_header.tileSize * 4; }
+
+    // TileBytes() of RGBA, nullptr for a tile with nothing on it
+    const uint8_t* Tile(uint32_t id) const {
+        const TiledMapFormat::TileEntry& e = m_table[id];
+        return e.offset != 0 ? m_map.Data() + e.offset : nullptr;
+    }
+
+    // w x h pixels from map pixel (x0, y0) into rgba, transparent off the map and where no tile is stored
+    void ReadRegion(int x0, int y0, int w, int h, uint8_t* rgba) const {
+        memset(rgba, 0, size_t(w) * size_t(h) * 4);
+        const int size = int(m_header.tileSize);
+        const int cx0 = std::max(x0, 0);
+        const int cy0 = std::max(y0, 0);
+        const int cx1 = int(std::min(int64_t(x0) + w, int64_t(m_header.width)));
+        const int cy1 = int(std::min(int64_t(y0) + h, int64_t(m_header.height)));
+        if (cx0 >= cx1 || cy0 >= cy1) {
+            return;
+        }
+        for (int ty = cy0 / size; ty <= (cy1 - 1) / size; ++ty) {
+            for (int tx = cx0 / size; tx <= (cx1 - 1) / size; ++tx) {
+                const uint8_t* tile = Tile(uint32_t(ty) * m_header.tilesX + uint32_t(tx));
+                if (!tile) {
+                    continue;
+                }
+                const int sx0 = std::max(cx0, tx * size);
+                const int sx1 = std::min(cx1, (tx + 1) * size);
+                const int sy0 = std::max(cy0, ty * size);
+                const int sy1 = std::min(cy1, (ty + 1) * size);
+                for (int y = sy0; y < sy1; ++y) {
+                    memcpy(rgba + (size_t(y - y0) * w + size_t(sx0 - x0)) * 4,
+                           tile + (size_t(y - ty * size) * size + size_t(sx0 - tx * size)) * 4, size_t(sx1 - sx0) * 4);
+                }
+            }
+        }
+    }
+
+private:
+    MappedFile                              m_map;
+    TiledMapFormat::Header                  m_header = {};
+    std::vector<TiledMapFormat::TileEntry>  m_table;
+};
+
+class TiledMap {
+public:
+    static const size_t kDefaultCapacity = 64;      // resident tiles, 16MB at 256 pixel tiles
+    static const int kMaxUploadsPerFrame = 8;       // spread texture uploads so a burst of loads doesn't hitch
+
+    TiledMap() {}
+
+    ~TiledMap() {
+        Close();
+    }
+
+    TiledMap(const TiledMap&) = delete;
+    TiledMap& operator=(const TiledMap&) = delete;
+
+    bool Open(const char* filename, size_t capacity = kDefaultCapacity) {
+        Close();
+        if (!m_file.Open(filename)) {
+            return false;
+        }
+        m_capacity = capacity;
+        m_quit = false;
+        m_thread = std::thread([this]() { LoaderLoop(); });
+        return true;
+    }
+
+    // GL thread, deletes every resident texture
+    void Close() {
+        if (m_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_quit = true;
+            }
+            m_wake.notify_one();
+            m_thread.join();
+        }
+        for (auto& entry : m_resident) {
+            glDeleteTextures(1, &entry.second->texture);
+        }
+        m_resident.clear();
+        m_lru.clear();
+        m_requests.clear();
+        m_loaded.clear();
+        m_pending.clear();
+        m_file.Close();
+    }
+
+    bool IsOpen() const { return m_file.IsOpen(); }
+    float Width() const { return float(m_file.Header().width); }
+    float Height() const { return float(m_file.Header().height); }
+    size_t NumResident() const { return m_resident.size(); }
+    size_t NumPending() const { return m_pending.size(); }
+    uint64_t NumLoads() const { return m_numLoads; }
+    uint64_t NumEvictions() const { return m_numEvictions; }
+
+    // GL thread, once per frame. The working set is every tile within radius of any of the points.
+    // Missing tiles are queued for loading, finished loads are uploaded and the cache trimmed.
+    void Update(const Vec2D* points, size_t count, float radius) {
+        if (!IsOpen()) {
+            return;
+        }
+        m_workingSet.clear();
+        const TiledMapFormat::Header& header = m_file.Header();
+        const float size = float(header.tileSize);
+        for (size_t i = 0; i < count; ++i) {
+            const int x0 = std::max(int(floorf((points[i].x - radius) / size)), 0);
+            const int y0 = std::max(int(floorf((points[i].y - radius) / size)), 0);
+            const int x1 = std::min(int(floorf((points[i].x + radius) / size)), int(header.tilesX) - 1);
+            const int y1 = std::min(int(floorf((points[i].y + radius) / size)), int(header.tilesY) - 1);
+            for (int ty = y0; ty <= y1; ++ty) {
+                for (int tx = x0; tx <= x1; ++tx) {
+                    const uint32_t id = uint32_t(ty) * header.tilesX + uint32_t(tx);
+                    if (m_file.Tile(id)) {
+                        m_workingSet.insert(id);
+                    }
+                }
+            }
+        }
+
+        // forget queued loads that have scrolled out of the working set before the loader gets to them
+        std::vector<uint32_t> requests;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto it = m_requests.begin(); it != m_requests.end();) {
+                if (m_workingSet.count(*it)) {
+                    ++it;
+                } else {
+                    m_pending.erase(*it);
+                    it = m_requests.erase(it);
+                }
+            }
+        }
+        for (uint32_t id : m_workingSet) {
+            auto it = m_resident.find(id);
+            if (it != m_resident.end()) {
+                m_lru.splice(m_lru.begin(), m_lru, it->second);
+            } else if (m_pending.insert(id).second) {
+                requests.push_back(id);
+            }
+        }
+        if (!requests.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_requests.insert(m_requests.end(), requests.begin(), requests.end());
+            }
+            m_wake.notify_one();
+        }
+
+        Upload();
+        Evict();
+    }
+
+    // GL thread, draws resident tiles only, anything still loading shows through as the clear colour
+    void Render() const {
+        const TiledMapFormat::Header& header = m_file.Header();
+        const float size = float(header.tileSize);
+        glEnable(GL_TEXTURE_2D);
+        glLoadIdentity();
+        glColor3f(1.0f, 1.0f, 1.0f);
+        for (const Tile& tile : m_lru) {
+            const float x0 = float(tile.id % header.tilesX) * size;
+            const float y0 = float(tile.id / header.tilesX) * size;
+            glBindTexture(GL_TEXTURE_2D, tile.texture);
+            glBegin(GL_QUADS);
+            glTexCoord2f(0.0f, 1.0f); glVertex3f(x0, y0 + size, 0.0f);
+            glTexCoord2f(1.0f, 1.0f); glVertex3f(x0 + size, y0 + size, 0.0f);
+            glTexCoord2f(1.0f, 0.0f); glVertex3f(x0 + size, y0, 0.0f);
+            glTexCoord2f(0.0f, 0.0f); glVertex3f(x0, y0, 0.0f);
+            glEnd();
+        }
+        glDisable(GL_TEXTURE_2D);
+    }
+
+private:
+    struct Tile {
+        uint32_t    id;
+        GLuint      texture;
+    };
+
+    struct Loaded {
+        uint32_t                    id;
+        std::vector<unsigned char>  pixels;
+    };
+
+    void LoaderLoop() {
+        for (;;) {
+            uint32_t id;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this]() { return m_quit || !m_requests.empty(); });
+                if (m_quit) {
+                    return;
+                }
+                id = m_requests.front();
+                m_requests.pop_front();
+            }
+            Loaded l;
+            l.id = id;
+            const uint8_t* src = m_file.Tile(id);
+            l.pixels.assign(src, src + m_file.TileBytes());
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_loaded.push_back(std::move(l));
+            }
+        }
+    }
+
+    void Upload() {
+        std::vector<Loaded> done;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            const size_t count = std::min(m_loaded.size(), size_t(kMaxUploadsPerFrame));
+            for (size_t i = 0; i < count; ++i) {
+                done.push_back(std::move(m_loaded.front()));
+                m_loaded.pop_front();
+            }
+        }
+        const GLsizei size = GLsizei(m_file.Header().tileSize);
+        for (const Loaded& l : done) {
+            m_pending.erase(l.id);
+            Tile tile;
+            tile.id = l.id;
+            glGenTextures(1, &tile.texture);
+            glBindTexture(GL_TEXTURE_2D, tile.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, l.pixels.data());
+            m_lru.push_front(tile);
+            m_resident[l.id] = m_lru.begin();
+            ++m_numLoads;
+        }
+    }
+
+    // drop least recently used tiles outside the working set until back under capacity
+    void Evict() {
+        auto it = m_lru.end();
+        while (m_resident.size() > m_capacity && it != m_lru.begin()) {
+            --it;
+            if (m_workingSet.count(it->id)) {
+                continue;
+            }
+            glDeleteTextures(1, &it->texture);
+            m_resident.erase(it->id);
+            it = m_lru.erase(it);
+            ++m_numEvictions;
+        }
+    }
+
+    TiledMapFile                            m_file;
+    size_t                                  m_capacity = kDefaultCapacity;
+
+    // loader thread hand off
+    std::thread                             m_thread;
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_wake;
+    std::deque<uint32_t>                    m_requests;
+    std::deque<Loaded>                      m_loaded;
+    bool                                    m_quit = false;
+
+    // GL thread only
+    std::list<Tile>                         m_lru;          // most recently used first
+    std::unordered_map<uint32_t, std::list<Tile>::iterator> m_resident;
+    std::unordered_set<uint32_t>            m_pending;      // requested, not uploaded yet
+    std::unordered_set<uint32_t>            m_workingSet;
+    uint64_t                                m_numLoads = 0;
+    uint64_t                                m_numEvictions = 0;
+};